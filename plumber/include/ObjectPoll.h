@@ -30,6 +30,7 @@
 #include <set>
 #include <vector>
 #include <map>
+#include <mutex>
 
 #include <fstream>
 #include <iostream>
@@ -38,12 +39,16 @@
 
 #include <sys/io.h>
 
+#include "PageMap.h"
+
 using namespace std;
 
 #define PAGE_SIZE (1L<<12)
 #define PAGE_SHIFT 12
 #define PAGEMAP_LENGTH 8
 #define POLL_SIZE (1L<<34)
+#define HUGE_PAGE_SIZE (1L<<21)
+#define HUGE_PAGE_SHIFT 21
 
 #define PTR_TO_ADDR(ptr) ( reinterpret_cast<unsigned long>(ptr) )
 #define ADDR_TO_PTR(addr) ( reinterpret_cast<void*>(addr) )
@@ -64,35 +69,105 @@ public:
 	}
 };
 
+// Translates the poll's addresses instead of the pagemap (e.g., to the
+// synthetic physical addresses of a simulated cache)
+class FrameTranslator {
+public:
+	virtual ~FrameTranslator() {}
+	virtual unsigned long translate(const void* ptr) = 0;
+};
+
 class ObjectPoll {
 	unsigned long objectSize;
 	unsigned long pollSize;
 
+	bool hugePages;
+	unsigned long pageSize;
+
+	// A poll that is backed by a file (on tmpfs or hugetlbfs) keeps its pages,
+	// and their page frames, after the process exits.
+	// A shared poll is backed by a sealed memfd that other processes can map
+	// through /proc/<pid>/fd/<fd>.
+	string backingFile;
+	int backingFd;
+	bool persistent;
+
 	char* poll;
-	char* pollGCPos;
 	char* pollPos;
 	char* pollEnd;
 
+	// The page that single objects are currently allocated from
+	char* objectPos;
+	char* objectEnd;
+
 	bool usePageOffset;
 	unsigned long pageOffset;
 
-	unsigned long freedPages;
+	// Per page count of live objects, indexed by the page number in the poll
+	vector<unsigned int> pageLiveObjects;
+	vector<bool> pageReleased;
+	vector<char*> freePages;
+	// Pages that were handed out (or restored) since the last GC, and that
+	// might never be claimed, wherever they are in the poll
+	vector<char*> gcPages;
+
+	// Guards the poll bookkeeping, so a poll can be shared between threads
+	recursive_mutex pollMutex;
+
+	PageMap* pagemap;
+	FrameTranslator* translator;
 
 public:
-	ObjectPoll(unsigned long objectSize, unsigned long pollSize);
+	ObjectPoll(unsigned long objectSize, unsigned long pollSize, bool hugePages = false,
+			const char* backingFile = NULL, bool shared = false);
 	virtual ~ObjectPoll();
 
 	void GC();
 	unsigned long getTotalAllocatedPoll();
+	unsigned long getPageSize() const { return pageSize; }
+	bool isHugePages() const { return hugePages; }
+	bool isPersistent() const { return persistent; }
+	bool isShared() const { return backingFd >= 0; }
+	unsigned long getPollSize() const { return pollSize; }
+	const string& getBackingFile() const { return backingFile; }
+
+	unsigned long getUsedSize() const { return pollPos - poll; }
+	unsigned long offsetOf(const void* p) const { return PTR_TO_ADDR(p) - PTR_TO_ADDR(poll); }
+	void* at(unsigned long offset) const { return poll + offset; }
+
+	// Takes back the first usedSize bytes of a persistent poll. The pages are
+	// locked but have no live objects until they are claimed again.
+	void restore(unsigned long usedSize);
 	void setPageOffset(void* p = NULL);
 
 	void* newObject();
+	void claimObject(void *p);
 	void deleteObject(void *p);
 
-	static unsigned long calculatePhyscialAddr(void* ptr);
+	// Allocates an entire page (a huge page in huge pages mode), locked and
+	// populated, so its objects can be constructed together from a single
+	// physical address translation.
+	// Freed pages are reused before new pages are taken from the poll.
+	// The page has no live objects until they are claimed.
+	// If a NUMA node is given, the page is bound to it before it is populated.
+	void* newPage(int node = -1);
+	void releasePage(void* page);
+	int getPageNode(void* page);
+
+	void setTranslator(FrameTranslator* translator) { this->translator = translator; }
+
+	unsigned long calculatePhyscialAddr(void* ptr);
+	unsigned long translatePage(void* page);
+	bool isPhysicallyContiguous(void* page);
+	unsigned long refreshTranslation(vector<unsigned long>& pageNumbers);
 
 private:
+	void mapPoll();
+	void mapBackingFile();
+	void mapSharedMemory();
 	void freeArea(void* p, unsigned long size);
+	char* pageFrame(char* p) const { return reinterpret_cast<char*>(PTR_TO_ADDR(p) & ~(pageSize - 1)); }
+	unsigned long pageIndex(void* p) const { return (PTR_TO_ADDR(p) - PTR_TO_ADDR(poll)) / pageSize; }
 };
 
 #endif /* OBJECTPOLL_H_ */
@@ -0,0 +1,63 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_PAGEMAP_H_
+#define PLUMBER_PAGEMAP_H_
+
+#include <vector>
+
+#include "plumber.hpp"
+
+using namespace std;
+
+class PageMapException: public PlumberException { using PlumberException::PlumberException; };
+
+/*
+ * Translates virtual addresses of a memory region to physical addresses using
+ * /proc/self/pagemap. The pagemap file is kept open, whole ranges are read
+ * with a single pread() and the page frames are cached per page.
+ */
+class PageMap {
+	int fd;
+
+	unsigned long basePage;
+	unsigned long pagesCount;
+
+	// Raw pagemap entries, indexed by the page number relative to the base page.
+	// A zero entry was not read yet (or the page is not present).
+	vector<unsigned long> entries;
+
+public:
+	PageMap(const void* base, unsigned long size);
+	virtual ~PageMap();
+
+	unsigned long translate(const void* ptr);
+
+	void load(const void* begin, unsigned long pages);
+	bool isContiguous(const void* begin, unsigned long pages);
+	unsigned long refresh(vector<unsigned long>& pageNumbers);
+	void invalidate(const void* begin, unsigned long pages);
+
+private:
+	bool isCached(unsigned long page) const;
+	unsigned long& entry(unsigned long page);
+	void read(unsigned long firstPage, unsigned long pages, unsigned long* buffer);
+	void reserve(unsigned long lastPage);
+};
+
+#endif /* PLUMBER_PAGEMAP_H_ */
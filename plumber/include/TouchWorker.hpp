@@ -42,6 +42,7 @@
 #include "Messages.h"
 #include "lineallocator.hpp"
 #include "timing.h"
+#include "topology.h"
 
 using namespace std;
 
@@ -69,6 +70,9 @@ private:
 	Allocator& allocator;
 	volatile Line::arr partitionsArray;
 
+	// The CPU the worker runs on, to touch its socket's LLC (-1: any)
+	int cpu;
+
 	TouchInfo info;
 
 	pthread_mutex_t mutex;
@@ -78,7 +82,7 @@ public:
 	volatile static bool touchForever;
 
 public:
-	TouchWorker(Allocator& allocator) : allocator(allocator), partitionsArray(NULL) {
+	TouchWorker(Allocator& allocator, int cpu = -1) : allocator(allocator), partitionsArray(NULL), cpu(cpu) {
 		mutex = PTHREAD_MUTEX_INITIALIZER;
 		pthread_cond_init(&cv, NULL);
 		restart();
@@ -186,12 +190,20 @@ private:
 	void flushPartitionsArray() {
 		if(partitionsArray != NULL) {
 			for(unsigned int i = 0; i < info.partitions; i++) {
-				partitionsArray[i]->flushSets();
+				if(allocator.getSimulator() != NULL) {
+					allocator.getSimulator()->flushSets(partitionsArray[i]);
+				} else {
+					partitionsArray[i]->flushSets();
+				}
 			}
 		}
 	}
 
 	void workerThread() {
+		if(cpu >= 0 && !pinThreadToCpus(vector<int>(1, cpu))) {
+			std::cout << "[ERROR] Failed pinning the touch worker to CPU " << cpu << endl;
+		}
+
 		lock();
 		while(waitForJob()) {
 			if(partitionsArray != NULL) {
@@ -200,8 +212,13 @@ private:
 				case TouchInfo::OP_TOUCH:
 					if(info.flushBefore) { flushPartitionsArray(); }
 
-					CacheLine::polluteSets(partitionsArray, info.partitions, TouchWorker::touchForever,
-							info.disableInterupts);
+					if(allocator.getSimulator() != NULL) {
+						allocator.getSimulator()->polluteSets(partitionsArray, info.partitions,
+								TouchWorker::touchForever);
+					} else {
+						CacheLine::polluteSets(partitionsArray, info.partitions, TouchWorker::touchForever,
+								info.disableInterupts);
+					}
 
 					if(info.flushAfter) { flushPartitionsArray(); }
 					break;
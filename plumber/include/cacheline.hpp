@@ -39,6 +39,7 @@
 #include <sys/io.h>
 
 #include "ObjectPoll.h"
+#include "linetable.hpp"
 #include "plumber.hpp"
 
 using namespace std;
@@ -103,7 +104,6 @@ public:
 	};
 
 private:
-	static ObjectPoll* poll;
 	static map<unsigned long, unsigned int> oldAddressMap;
 
 	static int pollute_dummy;
@@ -111,18 +111,13 @@ private:
 public:
 
 public:
+	// The line's own memory only holds the touch chain; the rest of its
+	// metadata is in the table.
 	ptr next;
-	unsigned int lineSize;
-	unsigned long physcialAddr;
-	unsigned long lineRelativePhyscialAddress;
-	unsigned long lineSet;
-	int cacheSlice;
-	unsigned int inSliceSetCount;
+	LineTable* table;
+	LineTable::id lineId;
 
-	char moreData[1];
-
-	CacheLine(unsigned int lineSize, unsigned int _inSliceSetCount);
-	void calculateSet();
+	CacheLine(LineTable* table, LineTable::id lineId);
 	void validatePhyscialAddr() const;
 
 	inline void setNext(ptr next_page) {
@@ -135,16 +130,20 @@ public:
 
 	void validateAll() const;
 
+	inline LineTable::id getId() const {
+		return lineId;
+	}
+
 	inline unsigned long getSet() const {
-		return lineSet;
+		return table->getSet(lineId);
 	}
 
 	inline unsigned long getInSliceSet() const {
-		return lineRelativePhyscialAddress % inSliceSetCount;
+		return table->getInSliceSet(lineId);
 	}
 
 	inline int getCacheSlice() const {
-		return cacheSlice;
+		return table->getCacheSlice(lineId);
 	}
 
 	void setCacheSlice(unsigned long _cacheSlice);
@@ -152,7 +151,11 @@ public:
 	void resetCacheSlice();
 
 	inline unsigned long getPhysicalAddr() const {
-		return physcialAddr;
+		return table->getPhysicalAddr(lineId);
+	}
+
+	inline int getNumaNode() const {
+		return table->getNumaNode(lineId);
 	}
 
 	unsigned long calculatePhyscialAddr() const;
@@ -172,12 +175,9 @@ public:
 	/*********************************************************************************************
 	 * Poll Control
 	 *********************************************************************************************/
-	static void allocatePoll(unsigned int setLineSize);
-	static void GC();
-	static unsigned long getTotalAllocatedPoll();
-	static void setPageOffset(ptr p = NULL);
-	static void operator delete(void *p) ;
-	static void* operator new(size_t size);
+	// Lines are only constructed in place, in their poll's memory
+	static void operator delete(void *p, void* place);
+	static void* operator new(size_t size, void* place);
 
 	/*********************************************************************************************
 	 * Backup
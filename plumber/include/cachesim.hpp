@@ -0,0 +1,137 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_CACHESIM_HPP_
+#define PLUMBER_CACHESIM_HPP_
+
+#include <pthread.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ObjectPoll.h"
+#include "cacheline.hpp"
+#include "cpuid_cache.h"
+#include "plumber.hpp"
+
+using namespace std;
+
+class CacheSimException: public PlumberException { using PlumberException::PlumberException; };
+
+/*
+ * The simulated cache. It is given as a comma separated list of key=value
+ * (e.g., "slices=12,ways=20,hash=table,policy=qlru,cat=0x3,jitter=8").
+ * Missing keys keep their defaults.
+ */
+struct CacheSimConfig {
+	enum HashType {
+		XOR_HASH,		// Each slice bit is a parity of address bits (power of 2 slices)
+		TABLE_HASH,		// A table lookup of a few parities (any slice count)
+	};
+
+	enum ReplacementPolicy {
+		LRU_POLICY,
+		QLRU_POLICY,	// Quad-age LRU: inserted at age 2, not 3, like the adaptive LLC
+		RANDOM_POLICY,
+	};
+
+	unsigned int lineSize;
+	unsigned int setsPerSlice;
+	unsigned int ways;
+	unsigned int slices;
+	HashType hash;
+	ReplacementPolicy policy;
+
+	// The ways that the process may fill (as in a CAT mask). 0: all the ways.
+	unsigned long catMask;
+
+	// Latencies in cycles. Each access is jittered uniformly, and some of the
+	// accesses are delayed by an interrupt-like outlier.
+	int hitLatency;
+	int missLatency;
+	int jitter;
+	double outlierRate;
+	int outlierLatency;
+
+	// The physical address space of the synthetic page frames
+	unsigned int physicalBits;
+	unsigned int seed;
+
+	CacheSimConfig();
+	static CacheSimConfig parse(const char* spec);
+};
+
+/*
+ * A software model of a sliced LLC, with synthetic physical addresses.
+ * It stands in for the hardware behind the tester, the poll's translation
+ * and the touch workers, and it knows the true slice of each address.
+ *
+ * The measurements of a tester are done under lock(), as the hardware ones
+ * are done with the interrupts disabled.
+ */
+class CacheSimulator : public FrameTranslator {
+	CacheSimConfig config;
+
+	// The tag (line address + 1, 0: invalid) and the age of each way,
+	// indexed by (slice * setsPerSlice + set) * ways + way
+	vector<unsigned long> tags;
+	vector<unsigned long> ages;
+	unsigned long clock;
+
+	// The parity masks of the slice hash, and the table of the table hash
+	vector<unsigned long> hashFunctions;
+	vector<int> hashTable;
+
+	unordered_map<unsigned long, unsigned long> frames;
+	unordered_set<unsigned long> usedFrames;
+
+	unsigned int seed;
+	pthread_mutex_t mutex;
+
+public:
+	CacheSimulator(const CacheSimConfig& config);
+	~CacheSimulator();
+
+	const CacheSimConfig& getConfig() const { return config; }
+	CacheInfo getCacheInfo() const;
+
+	void lock() { pthread_mutex_lock(&mutex); }
+	void unlock() { pthread_mutex_unlock(&mutex); }
+
+	// Must be called under lock(). Returns the latency of the access.
+	int access(unsigned long physcialAddr);
+	void flush(unsigned long physcialAddr);
+
+	int getSlice(unsigned long physcialAddr) const;
+	unsigned long getInSliceSet(unsigned long physcialAddr) const;
+
+	// A synthetic page frame for each virtual page, random and unique
+	virtual unsigned long translate(const void* ptr);
+
+	// Touches the lines' chains round-robin, as CacheLine::polluteSets()
+	void polluteSets(CacheLine::arr partitionsArray, unsigned long partitionsCount, volatile bool& continueFlag);
+	void flushSets(CacheLine::ptr line);
+
+private:
+	unsigned int random();
+	unsigned long parity(unsigned long x) const { return __builtin_parityl(x); }
+	int jittered(int latency);
+	unsigned long victim(unsigned long base);
+};
+
+#endif /* PLUMBER_CACHESIM_HPP_ */
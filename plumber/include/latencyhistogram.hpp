@@ -0,0 +1,148 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_LATENCYHISTOGRAM_HPP_
+#define PLUMBER_LATENCYHISTOGRAM_HPP_
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// A bin per unit of the timer, until the timer's calibration sets the bins
+// count (see getTimerHistogramBins()). Slower samples are counted in the
+// last bin.
+#define LATENCY_HISTOGRAM_BINS 2048
+
+/*
+ * A histogram of access times, in the units of the timer: cycles, counter
+ * ticks or nanoseconds (or LLC misses, with the PMU).
+ */
+class LatencyHistogram {
+	vector<unsigned long> bins;
+	unsigned long count;
+
+	static unsigned int& binsCount() {
+		static unsigned int count = LATENCY_HISTOGRAM_BINS;
+		return count;
+	}
+
+public:
+	LatencyHistogram() : bins(binsCount(), 0), count(0) {}
+
+	// The bins of the histograms that are cleared from now on
+	static void setBinsCount(unsigned int count) {
+		binsCount() = count;
+	}
+
+	int getBinsCount() const { return bins.size(); }
+
+	void add(int time) {
+		bins[std::min(std::max(time, 0), getBinsCount() - 1)] += 1;
+		count += 1;
+	}
+
+	void add(const int* times, unsigned long size) {
+		for(unsigned long i = 0; i < size; i++) {
+			add(times[i]);
+		}
+	}
+
+	void clear() {
+		bins.assign(binsCount(), 0);
+		count = 0;
+	}
+
+	unsigned long size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	int percentile(double p) const {
+		unsigned long target = (unsigned long)(p * count);
+		unsigned long seen = 0;
+		for(int t = 0; t < getBinsCount(); t++) {
+			seen += bins[t];
+			if(seen > target) {
+				return t;
+			}
+		}
+
+		return getBinsCount() - 1;
+	}
+
+	int median() const { return percentile(0.5); }
+
+	// The rate of the samples that are slower than the threshold
+	double rateAbove(int threshold) const {
+		if(count == 0) {
+			return 0;
+		}
+
+		unsigned long above = 0;
+		for(int t = std::max(threshold + 1, 0); t < getBinsCount(); t++) {
+			above += bins[t];
+		}
+
+		return (double)above / (double)count;
+	}
+
+	/*
+	 * Otsu's threshold of the two histograms together: the threshold that
+	 * maximizes the variance between the samples below and above it.
+	 * It is searched between the medians of the two, so a heavy tail of one
+	 * of them does not pull it outside.
+	 */
+	static int otsuThreshold(const LatencyHistogram& low, const LatencyHistogram& high) {
+		int begin = low.median();
+		int end = high.median();
+		if(end <= begin) {
+			return begin;
+		}
+
+		double total = low.count + high.count;
+		double sum = 0;
+		int size = std::min(low.getBinsCount(), high.getBinsCount());
+		for(int t = 0; t < size; t++) {
+			sum += (double)t * (double)(low.bins[t] + high.bins[t]);
+		}
+
+		double lowWeight = 0;
+		double lowSum = 0;
+		double bestVariance = -1;
+		int best = begin;
+		for(int t = 0; t < end; t++) {
+			double weight = low.bins[t] + high.bins[t];
+			lowWeight += weight;
+			lowSum += (double)t * weight;
+			if(t < begin || lowWeight == 0 || lowWeight == total) {
+				continue;
+			}
+
+			double highWeight = total - lowWeight;
+			double meanDiff = lowSum / lowWeight - (sum - lowSum) / highWeight;
+			double variance = lowWeight * highWeight * meanDiff * meanDiff;
+			if(variance > bestVariance) {
+				bestVariance = variance;
+				best = t;
+			}
+		}
+
+		return best;
+	}
+};
+
+#endif /* PLUMBER_LATENCYHISTOGRAM_HPP_ */
@@ -19,25 +19,58 @@
 #ifndef PLUMBER_LINEALLOCATOR_HPP_
 #define PLUMBER_LINEALLOCATOR_HPP_
 
+#include <pthread.h>
 #include <stddef.h>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
+#include <unordered_map>
 #include <utility>
 
+#include "cachesim.hpp"
 #include "cacheline.hpp"
 #include "cpuid_cache.h"
+#include "measuretrace.hpp"
 #include "slicedetector.hpp"
 #include "plumber.hpp"
+#include "sharedindex.h"
+#include "slicehash.hpp"
+#include "topology.h"
 
 using namespace std;
 
 class LineAllocatorException: public PlumberException { using PlumberException::PlumberException; };
 
-class CacheLineAllocator {
+// The slice hash is learned after this many sets were detected by timing,
+// and its lines are spot-checked by timing a few of them in each set.
+#define HASH_LEARN_SETS 4
+#define HASH_SPOT_CHECKS 4
+#define HASH_MAX_SAMPLES (1UL<<16)
+
+// The blocks are shrunk, down to a page, when more than this rate of the
+// lines of a set are in blocks of another slice
+#define BLOCK_CONFLICTS_RATE 0.05
+
+// Detection only reads the sets and the table, so the sets are detected in
+// parallel. Allocating and recording lines change them, and wait for it.
+class ReadLock {
+	pthread_rwlock_t& lock;
 public:
-	using CacheSets = map<unsigned int, CacheLine::uset>;
+	ReadLock(pthread_rwlock_t& lock) : lock(lock) { pthread_rwlock_rdlock(&lock); }
+	~ReadLock() { pthread_rwlock_unlock(&lock); }
+};
 
+class WriteLock {
+	pthread_rwlock_t& lock;
+public:
+	WriteLock(pthread_rwlock_t& lock) : lock(lock) { pthread_rwlock_wrlock(&lock); }
+	~WriteLock() { pthread_rwlock_unlock(&lock); }
+};
+
+class CacheLineAllocator {
 private:
 	const int cacheLevel;
 
@@ -49,21 +82,87 @@ private:
 	unsigned int setsPerSlice;
 
 	unsigned int linesPerSet;
+	// The ways usable by this process (e.g., under CAT). 0: probed on allocation
 	unsigned long availableWays;
 
+	// The socket whose LLC is allocated, and its local memory node (-1: any)
+	int socket;
+	int numaNode;
+	vector<int> socketCpus;
+
 	bool verbose;
 	bool printAllocationInformation;
 
+	// Each allocator has its own poll, with its own size, GC and accounting
+	unique_ptr<ObjectPoll> poll;
+
+	// Stands in for the hardware if set: cache geometry, physical addresses and timing
+	CacheSimulator* simulator;
+
+	// Records the measurements and the page frames, or replays a recorded run, if set
+	MeasureTrace* trace;
+
+	unique_ptr<LineTable> table;
 	CacheSets linesSets;
 	CacheSliceDetector detector;
 
+	// The detected slice of each physical block of 1 << blockShift bytes.
+	// A block covers at least a whole period of the in-slice sets, so each
+	// set has lines in the blocks that the previous sets recorded. It shrinks
+	// when its lines turn out to be in several slices.
+	unsigned int blockShift;
+	unordered_map<unsigned long, int> blockSlices;
+	// The in-slice sets whose slices were recorded in the blocks
+	vector<bool> recordedInSliceSets;
+	// Sets whose slices could not be renamed to the recorded slices
+	unsigned int unanchoredSets;
+	unsigned int ambiguousSets;
+
+	// The slice hash, learned from the detected sets
+	SliceHash sliceHash;
+	unsigned int recordedSets;
+
+	// Number of threads that detect sets in parallel (1: serial)
+	unsigned int detectionWorkers;
+	pthread_rwlock_t setsLock;
+
 	char lastFilename[512];
+	string publishedIndex;
 
 public:
 	CacheLineAllocator(int cacheLevel, unsigned int inputLinesPerSet = 0,
-			unsigned long availableWays = 2, bool verbose = false) : cacheLevel(cacheLevel), linesPerSet(inputLinesPerSet),
-			availableWays(availableWays), verbose(verbose), detector(verbose) {
-		cacheInfo = CacheInfo::getCacheLevel(cacheLevel);
+			unsigned long availableWays = 2, bool verbose = false,
+			bool hugePages = false, int socket = -1,
+			unsigned long pollSize = POLL_SIZE, const char* pollFile = NULL,
+			bool sharedPoll = false, CacheSimulator* simulator = NULL, MeasureTrace* trace = NULL) :
+			cacheLevel(cacheLevel), linesPerSet(inputLinesPerSet),
+			availableWays(availableWays), socket(socket), numaNode(-1), verbose(verbose),
+			simulator(simulator), trace(trace), detector(verbose),
+			blockShift(SLICE_BLOCK_SHIFT), unanchoredSets(0), ambiguousSets(0),
+			recordedSets(0), detectionWorkers(1) {
+		// Writers are preferred, so a waiting allocation is not starved by
+		// the detection of the other sets
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&setsLock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+
+		if(socket >= 0) {
+			socketCpus = getSocketCpus(socket);
+			if(socketCpus.empty()) {
+				throw LineAllocatorException("No CPUs on socket");
+			}
+			numaNode = getSocketNode(socket);
+		}
+
+		if(simulator != NULL) {
+			cacheInfo = simulator->getCacheInfo();
+		} else if(trace != NULL && trace->isReplaying()) {
+			cacheInfo = trace->getCacheInfo();
+		} else {
+			cacheInfo = CacheInfo::getCacheLevel(cacheLevel);
+		}
 		if(verbose) {
 			cacheInfo.print();
 		}
@@ -79,41 +178,143 @@ public:
 			linesPerSet = ways;
 		}
 
+		// The blocks (and the hash) start as wide as a period of the in-slice
+		// sets, even if the hash may use lower bits (e.g., 128 KiB blocks of
+		// 2048 sets per slice, where the hash may start at bit 16). All the
+		// lines of a set share the set index bits, so with narrower blocks the
+		// first set of each value of the top index bits shares no blocks with
+		// the recorded sets and can not be named by them, and a hash learned
+		// from the first sets never saw these bits vary. Starting wider assumes
+		// that these bits at-most rename the slices of a set (as an XOR hash
+		// does), which the blocks keep consistent. If they do more, the first
+		// sets of the other values conflict with the blocks, which are then
+		// shrunk, and the hash is learned again from the narrower blocks.
+		while((1UL << blockShift) < (unsigned long)setsPerSlice * lineSize) {
+			blockShift += 1;
+		}
+		recordedInSliceSets.assign(setsPerSlice, false);
+		sliceHash.reset(blockShift);
+
 		lastFilename[0] = 0;
 
-		CacheLine::allocatePoll(lineSize);
+		poll.reset(new ObjectPoll(lineSize, pollSize, hugePages, pollFile, sharedPoll));
+		poll->setTranslator(simulator);
+		detector.setSimulator(simulator);
+		if(trace != NULL) {
+			trace->attach(poll.get(), lineSize);
+			if(trace->isReplaying()) {
+				poll->setTranslator(trace);
+			}
+			detector.setTrace(trace);
+		}
+		table.reset(new LineTable(poll.get(), lineSize, setsPerSlice));
+		linesSets = CacheSets(sets);
 	}
 
 	~CacheLineAllocator() {
-		clean(0);
+		if(!publishedIndex.empty()) {
+			unlink(publishedIndex.c_str());
+		}
+
+		// The lines of a persistent poll are kept for the next run
+		if(!poll->isPersistent()) {
+			clean(0);
+		}
+
+		pthread_rwlock_destroy(&setsLock);
 	}
 
 public:
 	unsigned int getLinesPerSet() const { return linesPerSet; }
 	unsigned int getSetsCount() const { return sets; }
 	unsigned int getWaysCount() const { return ways; }
-	const CacheLine::uset& getSet(unsigned long set) { return linesSets[set]; }
+	unsigned long getAvailableWays() const { return availableWays; }
+	CacheSimulator* getSimulator() const { return simulator; }
+	int getSocket() const { return socket; }
+	const vector<int>& getCpus() const { return socketCpus; }
+	int getNumaNode() const { return numaNode; }
+	const CacheLine::vec& getSet(unsigned long set) { return linesSets[set]; }
+	unsigned long getTotalAllocatedPoll() { return poll->getTotalAllocatedPoll(); }
+	void setTestErrorBound(double bound) { detector.setErrorBound(bound); }
+	void setReductionMode(SetTester::ReductionMode mode) { detector.setReductionMode(mode); }
+	void setDetectionMode(CacheSliceDetector::DetectionMode mode) { detector.setDetectionMode(mode); }
+	void setDetectionWorkers(unsigned int workers) { detectionWorkers = workers; }
+	void setPmu(bool use) { detector.setPmu(use); }
+	void setAccessPattern(SetTester::AccessPattern pattern) { detector.setAccessPattern(pattern); }
+
+	// Detects sets from the shared order until it is done or another worker failed
+	void runDetectionWorker(int cpu, const vector<unsigned int>& order,
+			atomic<unsigned int>& next, atomic<bool>& failed);
 
 private:
-	CacheLine::ptr newLine() const { return new CacheLine(lineSize, setsPerSlice); }
+	CacheLine::ptr newLine(char* place, unsigned long physcialAddr, int node) {
+		auto id = table->add(reinterpret_cast<CacheLine::ptr>(place), physcialAddr, node);
+		CacheLine::ptr line;
+		try {
+			line = new (place) CacheLine(table.get(), id);
+		} catch (CacheLineException& e) {
+			table->remove(id);
+			throw;
+		}
+		poll->claimObject(place);
+		return line;
+	}
 
-	void allocateLine() { putLine(newLine()); }
+	void deleteLine(CacheLine::ptr line) {
+		table->remove(line->getId());
+		poll->deleteObject(line);
+	}
 
-	void discardLine(CacheLine::ptr line) {
-		auto curSet = line->getInSliceSet();
-		linesSets[curSet].erase(line);
+	// Re-read the physical addresses of all the lines' pages in bulk
+	template<typename T>
+	unsigned long refreshTranslation(const T& lines) {
+		vector<unsigned long> pageNumbers;
+		for(auto l = lines.begin(); l != lines.end(); ++l) {
+			pageNumbers.push_back(PTR_TO_ADDR(*l) >> PAGE_SHIFT);
+		}
 
-		curSet = line->getSet();
-		linesSets[curSet].erase(line);
+		return poll->refreshTranslation(pageNumbers);
+	}
 
-		delete line;
+	void allocatePage();
+	void allocateColoredPages(unsigned long set, unsigned long count);
+
+	void discardLine(CacheLine::ptr line) {
+		linesSets.erase(line->getInSliceSet(), line);
+		linesSets.erase(line->getSet(), line);
+
+		deleteLine(line);
 	}
 
 	void putLine(CacheLine::ptr line) {
-		unsigned long lineSet = line->getSet();
-		linesSets[lineSet].insert(line);
+		linesSets.insert(line->getSet(), line);
+	}
+
+	unsigned long getSliceBlock(CacheLine::ptr line) const {
+		return line->getPhysicalAddr() >> blockShift;
+	}
+
+	void detectSet(unsigned int curSet, CacheSliceDetector& detector);
+	// Reports the detected slices against a reference slice of each address
+	void validateSlices(const char* label, const char* matching, function<int(unsigned long)> trueSlice);
+	// The CPUs of the socket that may measure it
+	vector<int> getMeasuringCpus() const;
+	void detectAllSetsInParallel();
+	void printSetProgress(unsigned int curSet);
+
+	// The slice of the line by its block, or else by the slice hash (-1 if not known)
+	int getKnownSlice(const CacheLine::ptr& line) const {
+		auto block = blockSlices.find(getSliceBlock(line));
+		return block != blockSlices.end() ? block->second : sliceHash.getSlice(line->getPhysicalAddr());
 	}
 
+	bool propagateSlices(const CacheLine::vec& lines, CacheSliceDetector& detector);
+	bool spotCheckSlices(const CacheLine::vec& lines, const vector<CacheLine::vec>& evictionSets,
+			CacheSliceDetector& detector);
+	void recordSlices(const CacheLine::vec& lines);
+	void shrinkBlocks();
+	void learnSliceHash(const CacheLine::vec& lines);
+
 	bool isSetFull(unsigned long set) {
 		return linesSets[set].size() < linesPerSet;
 	}
@@ -150,10 +351,21 @@ public:
 
 	void allocateAllSets();
 	void rePartitionSets();
-	const CacheLine::uset& allocateSet(unsigned long set, unsigned long count);
+	const CacheLine::vec& allocateSet(unsigned long set, unsigned long count);
+	const CacheLine::vec& fillSets(unsigned long set, unsigned long count);
 
 	void print() const;
 	void write(const char* path);
+
+	// Save and restore the detected sets of a persistent poll
+	void save();
+	bool restore();
+
+	// Publish the detected sets of a shared poll to other processes
+	void publish(const char* indexFile);
+
+private:
+	string getMapFilename() const { return poll->getBackingFile() + ".map"; }
 };
 
 #endif /* PLUMBER_LINEALLOCATOR_HPP_ */
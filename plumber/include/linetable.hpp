@@ -0,0 +1,175 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_LINETABLE_HPP_
+#define PLUMBER_LINETABLE_HPP_
+
+#include <vector>
+
+#include "ObjectPoll.h"
+#include "plumber.hpp"
+
+using namespace std;
+
+class CacheLine;
+
+class LineTableException: public PlumberException { using PlumberException::PlumberException; };
+
+/*
+ * The metadata of the lines, kept out of the lines themselves as a struct of
+ * arrays indexed by the line's id. Scanning a column (e.g., the slices of all
+ * the lines) is sequential and does not touch the measured lines.
+ * Ids of deleted lines are reused by the next added line.
+ */
+class LineTable {
+public:
+	using id = unsigned int;
+
+private:
+	ObjectPoll* poll;
+	unsigned int lineSize;
+	unsigned int inSliceSetCount;
+
+	vector<CacheLine*> lines;
+	vector<unsigned long> physcialAddr;
+	vector<int> cacheSlice;
+	vector<unsigned int> lineSet;
+	vector<int> numaNode;
+
+	vector<id> freeIds;
+	unsigned long count;
+
+public:
+	LineTable(ObjectPoll* poll, unsigned int lineSize, unsigned int inSliceSetCount) :
+			poll(poll), lineSize(lineSize), inSliceSetCount(inSliceSetCount), count(0) {
+		unsigned int roundedSetCount;
+		for (roundedSetCount=1; roundedSetCount<inSliceSetCount; roundedSetCount*=2 );
+		if(roundedSetCount != inSliceSetCount) {
+			throw LineTableException("In slice set count must be a power of 2");
+		}
+	}
+
+	id add(CacheLine* line, unsigned long _physcialAddr, int _numaNode) {
+		id i;
+		if(!freeIds.empty()) {
+			i = freeIds.back();
+			freeIds.pop_back();
+		} else {
+			i = lines.size();
+			lines.push_back(NULL);
+			physcialAddr.push_back(0);
+			cacheSlice.push_back(-1);
+			lineSet.push_back(0);
+			numaNode.push_back(-1);
+		}
+
+		lines[i] = line;
+		physcialAddr[i] = _physcialAddr;
+		numaNode[i] = _numaNode;
+		setCacheSlice(i, -1);
+		count += 1;
+		return i;
+	}
+
+	void remove(id i) {
+		lines[i] = NULL;
+		freeIds.push_back(i);
+		count -= 1;
+	}
+
+	// Number of ids, including the ids of deleted lines
+	id end() const { return lines.size(); }
+	unsigned long size() const { return count; }
+
+	bool isUsed(id i) const { return lines[i] != NULL; }
+	CacheLine* line(id i) const { return lines[i]; }
+
+	ObjectPoll* getPoll() const { return poll; }
+	unsigned int getLineSize() const { return lineSize; }
+
+	unsigned long getPhysicalAddr(id i) const { return physcialAddr[i]; }
+	int getNumaNode(id i) const { return numaNode[i]; }
+	int getCacheSlice(id i) const { return cacheSlice[i]; }
+	unsigned long getSet(id i) const { return lineSet[i]; }
+
+	unsigned long getInSliceSet(id i) const {
+		return (physcialAddr[i] / lineSize) % inSliceSetCount;
+	}
+
+	void setCacheSlice(id i, int slice) {
+		cacheSlice[i] = slice;
+		lineSet[i] = getInSliceSet(i) | (slice < 0 ? 0 : (slice * inSliceSetCount));
+	}
+};
+
+/*
+ * The lines of each set, in dense flat arrays indexed by the set.
+ * The number of sets is fixed, so a reference to a set stays valid while
+ * lines are added and removed.
+ */
+class CacheSets {
+public:
+	using set = vector<CacheLine*>;
+
+private:
+	vector<set> sets;
+
+public:
+	CacheSets(unsigned long count = 0) : sets(count) {}
+
+	unsigned long size() const { return sets.size(); }
+
+	set& operator[](unsigned long s) {
+		if(s >= sets.size()) {
+			throw LineTableException("No such set");
+		}
+		return sets[s];
+	}
+
+	const set& operator[](unsigned long s) const {
+		if(s >= sets.size()) {
+			throw LineTableException("No such set");
+		}
+		return sets[s];
+	}
+
+	void insert(unsigned long s, CacheLine* line) {
+		(*this)[s].push_back(line);
+	}
+
+	// The order of the set is not kept
+	bool erase(unsigned long s, CacheLine* line) {
+		auto& lines = (*this)[s];
+		for(auto l = lines.begin(); l != lines.end(); ++l) {
+			if(*l == line) {
+				*l = lines.back();
+				lines.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void clear() {
+		for(auto s = sets.begin(); s != sets.end(); ++s) {
+			s->clear();
+		}
+	}
+};
+
+#endif /* PLUMBER_LINETABLE_HPP_ */
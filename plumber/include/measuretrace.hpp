@@ -0,0 +1,183 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_MEASURETRACE_HPP_
+#define PLUMBER_MEASURETRACE_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ObjectPoll.h"
+#include "cacheline.hpp"
+#include "cpuid_cache.h"
+#include "plumber.hpp"
+
+using namespace std;
+
+class MeasureTraceException: public PlumberException { using PlumberException::PlumberException; };
+
+/*
+ * A binary trace of the tester's measurements: the tested lines, the raw
+ * samples and the result of each one, with the page frames of the poll and
+ * the slices that the run detected.
+ *
+ * A recorded trace is replayed offline: the poll gets the recorded frames,
+ * and a measurement of the same lines gets the recorded samples. Once the
+ * replay asks a question that was not recorded (e.g., by another detector
+ * variant), its samples are drawn from the recorded hits and misses, by
+ * modeling the recorded slices as LRU sets.
+ *
+ * The lines are kept by their place in the poll, so the replay must use the
+ * same lines per set and huge pages mode. A replay with the same seed and a
+ * single detection worker asks the same questions as the recorded run.
+ */
+class MeasureTrace : public FrameTranslator {
+public:
+	enum Mode {
+		RECORD,
+		REPLAY,
+	};
+
+	enum Kind {
+		SAME_SET,		// The samples of the sequential test and its decision
+		TIME,			// The access times of the first line, and their median
+		TIME_MISS,		// The access times of a flushed line, and their minimum
+		SAMPLE_HIT,		// The calibration samples of a hit
+		SAMPLE_MISS,	// The calibration samples of a miss
+		PATTERN,		// The eviction samples of an access pattern: PATTERN + pattern
+	};
+
+	// A recorded measurement, for replay
+	struct Recording {
+		const uint16_t* samples;
+		unsigned int samplesCount;
+		int result;
+	};
+
+private:
+	Mode mode;
+	string path;
+	ObjectPoll* poll;
+	pthread_mutex_t mutex;
+
+	// The recorded run
+	unsigned int lineSize;
+	unsigned int setsPerSlice;
+	unsigned int slices;
+	unsigned int ways;
+	unsigned int availableWays;
+	unsigned int seed;
+	unsigned int blockShift;
+
+	// Recording: the frame numbers of the poll's pages
+	ofstream file;
+	unordered_set<unsigned long> recordedFrames;
+
+	// Replay: the frame of each base page by its offset in the poll, the
+	// slice of each block, and the measurements by their kind and lines
+	struct Stored {
+		unsigned long firstSample;
+		unsigned int samplesCount;
+		int result;
+	};
+	struct Queue {
+		vector<Stored> recordings;
+		unsigned int next;
+	};
+	unordered_map<unsigned long, unsigned long> frames;
+	unordered_map<unsigned long, int> blockSlices;
+	unordered_map<unsigned long, Queue> measurements;
+	vector<uint16_t> samples;
+	vector<int> hitSamples;
+	vector<int> missSamples;
+
+	// Statistics of the run, in both modes
+	atomic<unsigned long> measurementsCount;
+	atomic<unsigned long> sameSetTests;
+	atomic<unsigned long> replayedSamples;
+	atomic<unsigned long> modeledSamples;
+	atomic<unsigned long> matchingDecisions;
+	atomic<unsigned long> replayedDecisions;
+
+public:
+	MeasureTrace(const char* path, Mode mode);
+	~MeasureTrace();
+
+	bool isRecording() const { return mode == RECORD; }
+	bool isReplaying() const { return mode == REPLAY; }
+	const string& getPath() const { return path; }
+
+	void setSeed(unsigned int seed) { this->seed = seed; }
+	unsigned int getSeed() const { return seed; }
+	unsigned int getAvailableWays() const { return availableWays; }
+
+	// The lines are traced by their place in the poll
+	void attach(ObjectPoll* poll, unsigned int lineSize);
+
+	// Recording
+	void recordFrame(const void* page, unsigned long physcialAddr);
+	void recordMeasurement(int kind, CacheLine::arr lines, unsigned int count,
+			const int* times, unsigned long timesCount, int result);
+	// Writes the slice of each recorded block of 1 << blockShift bytes, as the
+	// run knows it (-1: unknown), and the cache, and completes the trace
+	void finish(const CacheInfo& info, unsigned int availableWays, unsigned int blockShift,
+			function<int(unsigned long physcialAddr)> slice);
+
+	// Replay
+	CacheInfo getCacheInfo() const;
+	virtual unsigned long translate(const void* ptr);
+
+	// The next recording of the measurement of these lines, if any is left
+	bool replay(int kind, CacheLine::arr lines, unsigned int count, Recording& recording);
+	// The recorded slice of the address, or -1 if it is not known
+	int getSlice(unsigned long physcialAddr) const;
+	// The set of the address by the recorded slices, or -1 if it is not known
+	long getSet(unsigned long physcialAddr) const;
+	// A sample of a recorded hit or miss
+	int drawSample(bool miss, unsigned int& seed) const;
+
+	void countSamples(unsigned long replayed, unsigned long modeled) {
+		replayedSamples += replayed;
+		modeledSamples += modeled;
+	}
+	void countDecision(bool matching) {
+		replayedDecisions += 1;
+		matchingDecisions += matching ? 1 : 0;
+	}
+
+	void print(unsigned int sets) const;
+
+private:
+	unsigned long lineIndex(CacheLine::ptr line) const { return poll->offsetOf(line) / lineSize; }
+	unsigned long key(int kind, CacheLine::arr lines, unsigned int count) const;
+	void load();
+
+	template<typename T>
+	void write(const T& value) {
+		file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+};
+
+#endif /* PLUMBER_MEASURETRACE_HPP_ */
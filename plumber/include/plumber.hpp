@@ -20,6 +20,7 @@
 #define PLUMBER_HPP_
 
 #include <exception>
+#include <sstream>
 #include <string>
 
 class PlumberException : public std::exception {
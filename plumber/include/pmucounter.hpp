@@ -0,0 +1,86 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_PMUCOUNTER_HPP_
+#define PLUMBER_PMUCOUNTER_HPP_
+
+#include <linux/perf_event.h>
+#include <cstddef>
+
+/*
+ * A per-thread LLC miss counter, read in user space with rdpmc (x86-64 only).
+ * It must be opened by the thread that measures, and only counts the
+ * misses of the user space, so the measured access is the only miss
+ * between two reads. It is pinned, so it is scheduled whenever the thread
+ * runs, unless the PMU is taken (e.g., by the NMI watchdog).
+ */
+class PmuCounter {
+	int fd;
+	volatile perf_event_mmap_page* page;
+	unsigned long long mask;
+
+public:
+	PmuCounter() : fd(-1), page(NULL), mask(0) {}
+	PmuCounter(const PmuCounter&) = delete;
+	~PmuCounter() { close(); }
+
+	// False if the counter is not available, or it can not be read with rdpmc
+	bool open();
+	void close();
+
+	bool isOpen() const { return fd >= 0; }
+
+	// Whether the counter can be read now. The measurements run with the
+	// interrupts disabled, so it stays readable throughout one.
+	bool isScheduled() const {
+		return page->index != 0;
+	}
+
+	// The hardware counter may change whenever the thread is scheduled, so
+	// it is read under the page's sequence lock. 0 if it is not scheduled.
+	unsigned long long read() const __attribute__((always_inline)) {
+#if defined(__x86_64__)
+		unsigned int seq;
+		unsigned long long count;
+		do {
+			seq = page->lock;
+			__asm__ __volatile__("" ::: "memory");
+			unsigned int index = page->index;
+			count = 0;
+			if(index != 0) {
+				unsigned int lo, hi;
+				__asm__ __volatile__("lfence; rdpmc; lfence" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+				count = ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
+			}
+			__asm__ __volatile__("" ::: "memory");
+		} while(page->lock != seq);
+		return count;
+#else
+		return 0;
+#endif
+	}
+
+	unsigned long long diff(unsigned long long start, unsigned long long end) const {
+		return (end - start) & mask;
+	}
+
+private:
+	bool open(unsigned int type, unsigned long long config);
+};
+
+#endif /* PLUMBER_PMUCOUNTER_HPP_ */
@@ -20,15 +20,83 @@
 #define PLUMBER_SETTESTER_HPP_
 
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <vector>
 #include <sys/io.h>
 
 #include "cacheline.hpp"
+#include "latencyhistogram.hpp"
+#include "pmucounter.hpp"
+
+class CacheSimulator;
+class MeasureTrace;
+
+// The distributions are sampled again every this many same-set tests. Once
+// the window is full, a threshold that no longer matches it is recalibrated.
+#define DRIFT_CHECK_TESTS 128
+#define DRIFT_WINDOW_SAMPLES 256
+#define DRIFT_TOLERANCE 0.1
+
+// A same-set test takes samples in batches of this size, up to this many
+// times the runs
+#define SPRT_BATCH 4
+#define SAME_SET_MAX_RETRIES 16
+
+// The measurements' memory is laid out by lines of this size in its pages
+#define TESTER_LINE_SIZE 64
+#define TESTER_LINES_PER_PAGE (PAGE_SIZE / TESTER_LINE_SIZE)
+// The samples of a measurement fill all the lines of two pages but one
+#define TESTER_SAMPLES_CAPACITY ((TESTER_LINES_PER_PAGE - 1) * (TESTER_LINE_SIZE / sizeof(int)))
+
+// The access patterns are compared on this many evictions
+#define PATTERN_CALIBRATION_RUNS 64
+#define PATTERN_MIN_GAIN 0.02
+
+class SetTesterException : public PlumberException { using PlumberException::PlumberException; };
 
 class SetTester {
+public:
+	// How a group that evicts its first line is reduced to a same-set group
+	enum ReductionMode {
+		LINEAR_REDUCTION,	// Drop one line per test: O(n) tests
+		GROUP_REDUCTION,	// Drop one of ways+1 chunks per test: O(w^2 log n) tests
+	};
+
+	// How the lines after the first one are accessed to evict it, by cost
+	enum AccessPattern {
+		SINGLE_PASS,			// Each line once
+		DOUBLE_PASS,			// All the lines twice
+		ZIG_ZAG,				// Forward, then backward
+		OVERLAPPING_WINDOWS,	// Sliding windows of a few lines, each window repeated
+		ACCESS_PATTERNS_COUNT
+	};
+
+private:
 	enum { TEST_LINES_ARRAYS = 7 };
 	CacheLine::arr testLinesArrays[TEST_LINES_ARRAYS];
 
+	// Each tester has its own random state and its own memory to read the
+	// lines into, so testers can run on several cores at once.
+	unsigned int seed;
+
+	// The samples of the measurements (two pages), and the scratch memory
+	// (a page). Only the lines at the tested line's offset in a page may be
+	// in its set, so these are skipped, and the measurement's own accesses
+	// never evict the tested lines. Nothing is allocated while measuring.
+	char* area;
+
+	// Count the LLC misses of the accesses instead of timing them, if the
+	// counter is available. It is opened by the thread that calls init().
+	bool usePmu;
+	PmuCounter pmu;
+
+	// Measure a simulated cache instead of the hardware, if set
+	CacheSimulator* simulator;
+
+	// Record the measurements to the trace, or replay them from it, if set
+	MeasureTrace* trace;
+
 public:
 	const unsigned long baseRuns;
 
@@ -47,19 +115,59 @@ public:
 	double avgMissAccessTime;
 	unsigned int llcMaxAccessTime;
 
-	SetTester() : baseRuns(16),
+	// The access times of a hit and of a miss, the threshold between them,
+	// and the rate of each above the threshold. They drive the sequential test.
+	LatencyHistogram hitHistogram;
+	LatencyHistogram missHistogram;
+	double hitHighRate;
+	double missHighRate;
+
+	// The recent access times, to detect drift of the distributions
+	LatencyHistogram recentHitHistogram;
+	LatencyHistogram recentMissHistogram;
+	unsigned int testsSinceDriftCheck;
+	unsigned int recalibrations;
+
+	// The probability of a wrong answer of a single same-set test
+	double errorBound;
+
+	// The log-likelihood ratios of a sample above and below the threshold,
+	// and the decision bound of the sequential test. They only change with
+	// the rates and the error bound (see updateSequentialTest()).
+	double highRatio;
+	double lowRatio;
+	double upperBound;
+
+	ReductionMode reductionMode;
+
+	// The access pattern, and whether it is picked by calibrateAccessPattern()
+	AccessPattern accessPattern;
+	bool autoAccessPattern;
+
+	SetTester() : usePmu(false), simulator(NULL), trace(NULL), baseRuns(16),
 			runs(baseRuns), maxTestLinesCount(0),
 			testLines(NULL), testLinesCount(0),
 			hitMedianSum(0), hitMedianCount(0),	avgHitAccessTime(0),
 			missMedianSum(0), missMedianCount(0), avgMissAccessTime(0),
-			llcMaxAccessTime(0) {
+			llcMaxAccessTime(0), hitHighRate(0.25), missHighRate(0.75),
+			testsSinceDriftCheck(0), recalibrations(0), errorBound(0.001),
+			reductionMode(GROUP_REDUCTION), accessPattern(SINGLE_PASS), autoAccessPattern(true) {
+		updateSequentialTest();
 		for (int i = 0; i < TEST_LINES_ARRAYS; ++i) {
 			testLinesArrays[i] = NULL;
 		}
+		seed = nextSeed();
+
+		area = (char*) mmap(0, 3 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if(area == MAP_FAILED) {
+			throw SetTesterException("Failed to map the measurements memory");
+		}
 	}
 
 	~SetTester() {
 		clearArrays();
+		munmap(area, 3 * PAGE_SIZE);
 	}
 
 	void doubleRuns() {
@@ -72,6 +180,9 @@ public:
 
 	void init(unsigned int maxTestLinesCount) {
 		this->maxTestLinesCount = maxTestLinesCount;
+		if(usePmu && !pmu.isOpen()) {
+			pmu.open();
+		}
 		clearArrays();
 		clear();
 		hitMedianSum = 0;
@@ -81,6 +192,114 @@ public:
 		missMedianCount = 0;
 		avgMissAccessTime = 0;
 		llcMaxAccessTime = 0;
+		hitHistogram.clear();
+		missHistogram.clear();
+		hitHighRate = 0.25;
+		missHighRate = 0.75;
+		recentHitHistogram.clear();
+		recentMissHistogram.clear();
+		testsSinceDriftCheck = 0;
+		recalibrations = 0;
+		updateSequentialTest();
+	}
+
+	void setErrorBound(double bound) {
+		errorBound = bound;
+		updateSequentialTest();
+	}
+
+	void updateSequentialTest() {
+		highRatio = log(missHighRate / hitHighRate);
+		lowRatio = log((1. - missHighRate) / (1. - hitHighRate));
+		upperBound = log((1. - errorBound) / errorBound);
+	}
+
+	void setReductionMode(ReductionMode mode) {
+		reductionMode = mode;
+	}
+
+	void setAccessPattern(AccessPattern pattern) {
+		accessPattern = pattern;
+		autoAccessPattern = false;
+	}
+
+	static const char* getAccessPatternName(AccessPattern pattern);
+	static bool parseAccessPattern(const char* name, AccessPattern& pattern);
+
+	// Picks the pattern that evicts the line by the eviction set most often.
+	// The eviction rate of each pattern is written to evictionRates, if given.
+	AccessPattern calibrateAccessPattern(CacheLine::ptr line, const CacheLine::vec& evictionSet,
+			unsigned int count, double* evictionRates = NULL);
+
+	void setPmu(bool use) {
+		usePmu = use;
+		if(!use) {
+			pmu.close();
+		}
+	}
+
+	bool isUsingPmu() const {
+		return usePmu;
+	}
+
+	void setSimulator(CacheSimulator* simulator) {
+		this->simulator = simulator;
+	}
+
+	CacheSimulator* getSimulator() const {
+		return simulator;
+	}
+
+	void setTrace(MeasureTrace* trace) {
+		this->trace = trace;
+	}
+
+	MeasureTrace* getTrace() const {
+		return trace;
+	}
+
+	// The testers' seeds are drawn in order from this seed, so a run can be
+	// reproduced, e.g., to replay its trace
+	static void seedTesters(unsigned int seed);
+	static unsigned int nextSeed();
+
+	bool isPmuOpen() const {
+		return pmu.isOpen();
+	}
+
+	// The counter to measure with, or NULL to time the accesses. If the
+	// counter is lost, the threshold is calibrated again on the line.
+	const PmuCounter* getPmu(CacheLine::ptr line);
+
+	// A xorshift generator: a few cycles and no shared state
+	unsigned int random() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+
+	static unsigned long getLineInPage(CacheLine::ptr line) {
+		return (PTR_TO_ADDR(line) / TESTER_LINE_SIZE) % TESTER_LINES_PER_PAGE;
+	}
+
+	// A random int of the scratch page, on a line of another set than the tested line
+	int* getScratch(CacheLine::ptr tested, unsigned int draw) {
+		unsigned long line = (getLineInPage(tested) + 1 + draw % (TESTER_LINES_PER_PAGE - 1)) % TESTER_LINES_PER_PAGE;
+		auto scratch = (int*) (area + 2 * PAGE_SIZE + line * TESTER_LINE_SIZE);
+		return scratch + (draw / TESTER_LINES_PER_PAGE) % (TESTER_LINE_SIZE / sizeof(int));
+	}
+
+	// The samples of the measurement of the tested line: the lines after it
+	// in the first page, and before it in the second, TESTER_SAMPLES_CAPACITY
+	// in all. A same-set test keeps all of its samples, for the trace.
+	int* getTimes(CacheLine::ptr tested) {
+		return (int*) (area + (getLineInPage(tested) + 1) * TESTER_LINE_SIZE);
+	}
+
+	// The samples of a measurement of this many runs
+	static unsigned long getSamplesCount(unsigned long runs) {
+		return std::min<unsigned long>(runs, TESTER_SAMPLES_CAPACITY);
 	}
 
 	CacheLine::arr getRandomArray();
@@ -124,7 +343,7 @@ public:
 		auto len = lines.size();
 
 		while(count > 0) {
-			unsigned int index = rand() % len;
+			unsigned int index = random() % len;
 			add(lines[index]);
 			len -= 1;
 			auto tmp = lines[len];
@@ -182,9 +401,15 @@ public:
 			avgMissAccessTime = (double) missMedianSum / (double) missMedianCount;
 		}
 
-		llcMaxAccessTime = avgHitAccessTime*0.85 + avgMissAccessTime*0.15;
+		sampleFirst(hitHistogram, missHistogram);
+		calibrateThreshold();
 	}
 
+	void sampleFirst(LatencyHistogram& hits, LatencyHistogram& misses);
+	// Whether a threshold that separates the hits from the misses was set
+	bool calibrateThreshold();
+	void checkDrift();
+
 	void swap(unsigned int u, unsigned int v) {
 		CacheLine::ptr tmp = testLines[u];
 		testLines[u] = testLines[v];
@@ -192,6 +417,14 @@ public:
 	}
 
 	CacheLine::vec getSameSetGroup(unsigned int availableWays);
+
+private:
+	// Takes the measurement with the probe of the backend, and records it
+	template<typename Measurement>
+	int measure(int kind, CacheLine::arr lines, unsigned int count, Measurement measurement);
+
+	unsigned int linearReduction(unsigned int availableWays);
+	unsigned int groupReduction(unsigned int availableWays);
 };
 
 #endif /* PLUMBER_SETTESTER_HPP_ */
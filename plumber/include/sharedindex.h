@@ -0,0 +1,54 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_SHAREDINDEX_H_
+#define PLUMBER_SHAREDINDEX_H_
+
+#include <stdint.h>
+
+/*
+ * The index that plumber publishes for a shared poll, so other processes can
+ * map the poll and touch the detected lines directly.
+ *
+ * The file is a header, followed by linesCount entries sorted by set.
+ * Map pollSize bytes of pollPath (MAP_SHARED) and add an entry's offset to
+ * the mapping to get a line.
+ */
+#define PLUMBER_INDEX_MAGIC 0x7864696d756c70UL // "plumidx"
+#define PLUMBER_INDEX_VERSION 1
+
+struct PlumberIndexHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t lineSize;
+	uint32_t sets;
+	uint32_t setsPerSlice;
+	uint32_t slices;
+	uint32_t reserved;
+	uint64_t pollSize;
+	uint64_t linesCount;
+	char pollPath[256];
+};
+
+struct PlumberIndexEntry {
+	uint32_t set;
+	uint32_t slice;
+	uint64_t offset;
+};
+
+#endif /* PLUMBER_SHAREDINDEX_H_ */
@@ -41,6 +41,11 @@
 #include "settester.hpp"
 
 #define LLC 3
+
+// The usable ways are the median of this many probes
+#define WAYS_PROBES 3
+#define WAYS_PROBE_RETRIES 8
+
 using namespace std;
 
 class NeedMoreLinesException : public exception {
@@ -59,6 +64,13 @@ public:
 	}
 
 class CacheSliceDetector {
+public:
+	enum DetectionMode {
+		PER_SLICE_DETECTION,	// Find a random group of each slice, slice by slice, and classify the lines once
+		CONFLICT_SET_DETECTION,	// Split one conflict set of all the slices in one pass
+	};
+
+private:
 	const double anomalyFactor = 1.6;
 	const unsigned int initRuns = 64;
 
@@ -71,14 +83,18 @@ class CacheSliceDetector {
 	unsigned int* maxTestGroupRetires;
 	SetTester tester;
 	bool didWarmup;
+	bool didCalibratePattern;
+	unsigned int reportedRecalibrations;
+
+	DetectionMode detectionMode;
 
 	bool verbose;
 
 public:
 	CacheSliceDetector(bool verbose) :
 		slicesCount(0), availWays(0), linesPerSet(0),
-		bestRandomTestGroupSize(NULL), maxTestGroupRetires(NULL), didWarmup(false),
-		verbose(verbose) {
+		bestRandomTestGroupSize(NULL), maxTestGroupRetires(NULL), didWarmup(false), didCalibratePattern(false), reportedRecalibrations(0),
+		detectionMode(PER_SLICE_DETECTION), verbose(verbose) {
 	}
 
 	~CacheSliceDetector() {
@@ -104,7 +120,17 @@ public:
 		calculateBestRandomTestGroupSize();
 
 		unsigned int maxTestGroupSize = *max_element(bestRandomTestGroupSize, bestRandomTestGroupSize+slicesCount);
+		// A conflict set holds at-most the available ways of each slice
+		maxTestGroupSize = max(maxTestGroupSize, getMaxConflictSetSize());
 		tester.init(maxTestGroupSize + 1);
+		reportedRecalibrations = 0;
+		// The tester is calibrated again
+		didWarmup = false;
+		didCalibratePattern = false;
+
+		if(tester.isUsingPmu() && !tester.isPmuOpen()) {
+			VERBOSE("[PMU] LLC miss counter is not available, timing the accesses" << endl);
+		}
 	}
 
 	void calculateBestRandomTestGroupSize() {
@@ -117,8 +143,15 @@ public:
 			double minExpectedTestRuns = std::numeric_limits<double>::infinity();
 			unsigned int correspondingSize = availWays+1;
 
-			for(unsigned int size=availWays+1; size < minExpectedTestRuns; size++) {
-				double curE = calculateExpectedTestsCountForGroupSize(size, undetectedSlices);
+			bool groupReduction = tester.reductionMode == SetTester::GROUP_REDUCTION;
+			// The group reduction tests grow logarithmically with the size, so
+			// the size is not bounded by the expected tests count.
+			unsigned int maxGroupSize = 4 * (availWays+1) * undetectedSlices;
+
+			for(unsigned int size=availWays+1; size < minExpectedTestRuns || (groupReduction && size < maxGroupSize); size++) {
+				double curE = groupReduction ?
+						calculateExpectedTestsCountForGroupReduction(size, undetectedSlices) :
+						calculateExpectedTestsCountForGroupSize(size, undetectedSlices);
 				if(curE < minExpectedTestRuns) {
 					minExpectedTestRuns = curE;
 					correspondingSize = size;
@@ -126,7 +159,9 @@ public:
 			}
 
 			bestRandomTestGroupSize[slice] = correspondingSize;
-			maxTestGroupRetires[slice] = calculateMaximumTestForGroupSize(correspondingSize, undetectedSlices);
+			maxTestGroupRetires[slice] = groupReduction ?
+					calculateMaximumTestForGroupReduction(correspondingSize, undetectedSlices) :
+					calculateMaximumTestForGroupSize(correspondingSize, undetectedSlices);
 
 			VERBOSE("[CALC Slice: " << slice << "] Best random test group size: " << bestRandomTestGroupSize[slice] << endl);
 			VERBOSE("[CALC Slice: " << slice << "] Expected test runs: " << minExpectedTestRuns << endl);
@@ -201,6 +236,62 @@ public:
 		return ( logEpsilon / ( (S-A) * log(q) ) ) + 1.;
 	}
 
+	double calculateGroupFailProbability(unsigned int size, unsigned int slices) {
+		// The probability that less then A of the other S-1 lines in the group
+		// are in the same slice as the first line (out of Z slices):
+		//
+		//	                               |S-1|   | 1 |^x   |Z-1|^(S-1-x)
+		//	P(fail) = Sum for x=0 to A-1:  |   | * |---|   * |---|
+		//	                               | x |   | Z |     | Z |
+		//
+		double p = 1. / (double)slices;
+		double q = 1. - p;
+		unsigned int n = size - 1;
+
+		double fail = 0.;
+		double binomial = 1.;
+		for(unsigned int x=0; x < availWays && x <= n; x++) {
+			fail += binomial * pow(p, x) * pow(q, n-x);
+			binomial = binomial * (n-x) / (x+1.);
+		}
+
+		// The sum may round above 1 when the group can hardly ever evict
+		return std::min(fail, 1.);
+	}
+
+	double calculateExpectedTestsCountForGroupReduction(unsigned int size, unsigned int slices) {
+		double S = size;
+		double A = availWays;
+
+		// The expected number of tries until a random group evicts its first line
+		double fail = calculateGroupFailProbability(size, slices);
+		if(fail >= 1.) {
+			return std::numeric_limits<double>::infinity();
+		}
+		double E1 = 1. / (1. - fail);
+
+		// Then each round of the group reduction drops one of A+1 chunks, so the
+		// S-1 lines are shrunk by a factor of A/(A+1) until only A are left.
+		// Until a chunk can be dropped, about half of the chunks are tested.
+		//
+		//	       log((S-1)/A)     A+2
+		//	E2 = ---------------- * ---
+		//	      log((A+1)/A)      2
+		//
+		double E2 = 0.;
+		if(size > availWays+1) {
+			E2 = ceil(log((S-1.)/A) / log((A+1.)/A)) * (A+2.) / 2.;
+		}
+
+		return E1 + E2;
+	}
+
+	double calculateMaximumTestForGroupReduction(unsigned int size, unsigned int slices) {
+		// As in calculateMaximumTestForGroupSize(), with the exact fail probability
+		double logEpsilon = -100;
+		return ( logEpsilon / log(calculateGroupFailProbability(size, slices)) ) + 1.;
+	}
+
 	void doubleRuns() {
 		tester.doubleRuns();
 	}
@@ -209,17 +300,133 @@ public:
 		tester.restartRuns();
 	}
 
-	static void flushAllLines(const CacheLine::uset& lines) {
+	void setErrorBound(double bound) {
+		tester.setErrorBound(bound);
+	}
+
+	void setReductionMode(SetTester::ReductionMode mode) {
+		tester.setReductionMode(mode);
+	}
+
+	void setDetectionMode(DetectionMode mode) {
+		detectionMode = mode;
+	}
+
+	void setPmu(bool use) {
+		tester.setPmu(use);
+	}
+
+	void setAccessPattern(SetTester::AccessPattern pattern) {
+		tester.setAccessPattern(pattern);
+	}
+
+	void setSimulator(CacheSimulator* simulator) {
+		tester.setSimulator(simulator);
+	}
+
+	void setTrace(MeasureTrace* trace) {
+		tester.setTrace(trace);
+	}
+
+	/*
+	 * The first detected slice gives an eviction set and another line of
+	 * the same set, which the access patterns are compared on.
+	 */
+	void calibrateAccessPattern(const CacheLine::vec& lines, const CacheLine::vec& evictionSet, int slice) {
+		if(didCalibratePattern || !tester.autoAccessPattern || evictionSet.size() < availWays) {
+			return;
+		}
+
+		for(auto line=lines.begin(); line != lines.end(); line++) {
+			if((*line)->getCacheSlice() != slice ||
+					find(evictionSet.begin(), evictionSet.end(), *line) != evictionSet.end()) {
+				continue;
+			}
+
+			double rates[SetTester::ACCESS_PATTERNS_COUNT];
+			auto pattern = tester.calibrateAccessPattern(*line, evictionSet, availWays, rates);
+			didCalibratePattern = true;
+
+			if(verbose) {
+				std::cout << "[PATTERN] Eviction rates:";
+				for(int p = 0; p < SetTester::ACCESS_PATTERNS_COUNT; p++) {
+					std::cout << " " << SetTester::getAccessPatternName((SetTester::AccessPattern)p) << ": " << rates[p];
+				}
+				std::cout << " => " << SetTester::getAccessPatternName(pattern) << endl;
+			}
+			return;
+		}
+	}
+
+	// Copies the settings of another detector, but not its calibration
+	void copySettings(const CacheSliceDetector& other) {
+		tester.setErrorBound(other.tester.errorBound);
+		tester.setReductionMode(other.tester.reductionMode);
+		tester.setPmu(other.tester.isUsingPmu());
+		tester.setSimulator(other.tester.getSimulator());
+		tester.setTrace(other.tester.getTrace());
+		if(!other.tester.autoAccessPattern) {
+			tester.setAccessPattern(other.tester.accessPattern);
+		}
+		detectionMode = other.detectionMode;
+	}
+
+	unsigned int random() {
+		return tester.random();
+	}
+
+	unsigned int getMaxConflictSetSize() const {
+		return availWays * slicesCount;
+	}
+
+	static void flushAllLines(const CacheLine::vec& lines) {
 		for(auto it=lines.begin(); it != lines.end(); ++it) {
 			(*it)->flushFromCache();
 		}
 	}
 
-	CacheLine::vec findTestGroupForSlice(CacheLine::vec& fromLines, unsigned int curSlice) {
-		for(unsigned int i=0; i < maxTestGroupRetires[curSlice]; ++i) {
+	/*
+	 * Finds a line that none of the eviction sets evict, so it is of a slice
+	 * that has no eviction set yet. Returns NULL if there is none.
+	 */
+	CacheLine::ptr findLineOfNewSlice(const CacheLine::vec& fromLines, const vector<CacheLine::vec>& evictionSets) {
+		CacheLine::vec order(fromLines);
+		for(auto i = order.size(); i > 1; i--) {
+			std::swap(order[i-1], order[tester.random() % i]);
+		}
+
+		for(auto line=order.begin(); line != order.end(); line++) {
+			if(!isEvictedByAny(*line, evictionSets)) {
+				return *line;
+			}
+		}
+
+		return NULL;
+	}
+
+	bool isEvictedByAny(CacheLine::ptr line, const vector<CacheLine::vec>& evictionSets) {
+		for(auto e=evictionSets.begin(); e != evictionSets.end(); e++) {
+			tester.clear();
+			tester.add(*e, availWays);
+			if(tester.isOnSameSet(line)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/*
+	 * Finds a group of the available ways of the first line's slice. The rest
+	 * of the group is drawn from the lines of all the slices, as the first
+	 * slice's group is.
+	 */
+	CacheLine::vec findTestGroupForSlice(CacheLine::ptr first, CacheLine::vec& fromLines) {
+		for(unsigned int i=0; i < maxTestGroupRetires[0]; ++i) {
 			// Most of the times, the lines won't be in the same set (short access time)
 			tester.clear();
-			tester.addRandom(fromLines, bestRandomTestGroupSize[curSlice]);
+			tester.add(first);
+			tester.addRandom(fromLines, bestRandomTestGroupSize[0] - 1);
 
 			auto testGroup = tester.getSameSetGroup(availWays);
 
@@ -231,76 +438,86 @@ public:
 		return CacheLine::vec();
 	}
 
-	unsigned int findAllLinesOnSameSet(const CacheLine::uset& lines, const CacheLine::vec& testGroup, unsigned int sliceId) {
-		unsigned int count = 0;
-
-		tester.clear();
-		tester.add(testGroup, availWays);
+	/*
+	 * Finds an eviction set for each slice, slice by slice: the first line of
+	 * each group is one that the previous eviction sets do not evict.
+	 */
+	vector<CacheLine::vec> findEvictionSetsBySlice(const CacheLine::vec& lines) {
+		vector<CacheLine::vec> evictionSets;
+		CacheLine::vec candidates(lines);
 
-		for(auto line=lines.begin(); line != lines.end(); line++) {
-			if(tester.isOnSameSet(*line)) {
-				(*line)->setCacheSlice(sliceId);
-				count += 1;
+		for(unsigned int curSlice=0; curSlice < slicesCount; ++curSlice) {
+			VERBOSE("[SLICE: " << setfill(' ') << setw(3) << dec << curSlice << "] Find-First");
+			auto first = findLineOfNewSlice(candidates, evictionSets);
+			if(first == NULL) {
+				VERBOSE(" [FAILED] No line of a new slice" << endl);
+				throw NeedMoreLinesException("No line of a new slice");
 			}
-		}
 
-		for(auto line=testGroup.begin(); line != testGroup.end(); line++) {
-			if((*line)->getCacheSlice() != (int)sliceId) {
-				(*line)->setCacheSlice(sliceId);
-				count += 1;
+			candidates.erase(find(candidates.begin(), candidates.end(), first));
+			if(candidates.size() + 1 < bestRandomTestGroupSize[0]) {
+				VERBOSE(" [FAILED] Not enough undetected lines" << endl);
+				throw NeedMoreLinesException("Not enough undetected lines");
 			}
-		}
 
-		return count;
-	}
-
-	unsigned int detectSlice(const CacheLine::uset& lines, unsigned int curSlice) {
-		VERBOSE("[SLICE: " << setfill(' ') << setw(3) << dec << curSlice << "] Find-Undetected");
-		CacheLine::vec undetected = getAllUndetectedLines(lines);
+			VERBOSE(", Find-Group");
+			CacheLine::vec testGroup = findTestGroupForSlice(first, candidates);
 
-		if(undetected.size() < bestRandomTestGroupSize[curSlice]) {
-			VERBOSE(" [FAILED] Not enough undetected lines" << endl);
-			throw NeedMoreLinesException("Not enough undetected lines");
-		}
-
-		VERBOSE(", Find-Group");
-		CacheLine::vec testGroup = findTestGroupForSlice(undetected, curSlice);
+			// A first line that a noisy test did not evict gives a group of a
+			// slice that already has an eviction set
+			if(testGroup.size() < availWays || isEvictedByAny(testGroup[1], evictionSets)) {
+				VERBOSE(" [FAILED] Could not detect small group in the same slice" << endl);
+				throw NeedMoreLinesException("Could not detect small group in the same slice");
+			}
 
-		if (testGroup.size() < availWays) {
-			VERBOSE(" [FAILED] Could not detect small group in the same slice" << endl);
-			throw NeedMoreLinesException("Could not detect small group in the same slice");
+			for(auto l=testGroup.begin(); l != testGroup.end(); l++) {
+				auto c = find(candidates.begin(), candidates.end(), *l);
+				if(c != candidates.end()) {
+					candidates.erase(c);
+				}
+			}
+			evictionSets.push_back(testGroup);
+			VERBOSE(" [SUCCESS]" << endl);
 		}
 
-		VERBOSE(", Find-Entire-Set");
-		unsigned int count = findAllLinesOnSameSet(lines, testGroup, curSlice);
-
-		double sameSetRatio = (double)count / (double)lines.size();
-		VERBOSE(" [SUCCESS] Total: " << setfill(' ') << setw(6) << count << " (ratio: " << sameSetRatio << ")" << endl);
+		return evictionSets;
+	}
 
-		if(count < linesPerSet) {
-			VERBOSE(" [FAILED] Not enough lines for each set" << endl);
-			throw NeedMoreLinesException("Not enough lines for each set");
-		}
+	void detectBySlice(const CacheLine::vec& lines) {
+		vector<CacheLine::vec> evictionSets = findEvictionSetsBySlice(lines);
 
-		return count;
+		VERBOSE("[CLASSIFY]");
+		classifyAllLines(lines, evictionSets);
 	}
 
-	void reset(const CacheLine::uset& lines) {
+	void reset(const CacheLine::vec& lines) {
 		for(auto i=lines.begin(); i != lines.end(); i++) {
 			(*i)->resetCacheSlice();
 		}
 	}
 
-	void detectAllCacheSlices(const CacheLine::uset& lines) {
+	void detectAllCacheSlices(const CacheLine::vec& lines) {
 		if(!didWarmup) {
 			warmup(lines);
 		}
 		reset(lines);
 
-		for(unsigned int curSlice=0; curSlice < slicesCount; ++curSlice) {
-			detectSlice(lines, curSlice);
+		if(tester.recalibrations > reportedRecalibrations) {
+			reportedRecalibrations = tester.recalibrations;
+			VERBOSE("[DRIFT] Recalibrated threshold: " << dec << tester.llcMaxAccessTime << " - "
+					<< "Hit/Miss above threshold: " << tester.hitHighRate << "/" << tester.missHighRate << endl);
+		}
+
+		if(detectionMode == CONFLICT_SET_DETECTION) {
+			detectByConflictSet(lines);
+		} else {
+			detectBySlice(lines);
 		}
 
+		checkAllDetected(lines);
+	}
+
+	void checkAllDetected(const CacheLine::vec& lines) {
 		CacheLine::vec undetected = getAllUndetectedLines(lines);
 		if(undetected.size() > 0) {
 			if(verbose) {
@@ -308,10 +525,213 @@ public:
 			}
 			throw CacheLineException(this, "Found undetected lines");
 		}
+	}
+
+	bool isEvictedBy(CacheLine::ptr line, const CacheLine::vec& group, CacheLine::ptr without = NULL) {
+		tester.clear();
+		for(auto l=group.begin(); l != group.end(); l++) {
+			if(*l != without) {
+				tester.add(*l);
+			}
+		}
+
+		return tester.isOnSameSet(line);
+	}
+
+	/*
+	 * Finds the number of ways this process can actually use (e.g., under a
+	 * CAT mask). A group of lines of the same in-slice set is grown until it
+	 * evicts a target line, and is then reduced to a minimal group that still
+	 * evicts it. All of the minimal group is in the target's set, so its size
+	 * is the number of usable ways.
+	 * Returns the median of a few probes, or 0 if no probe succeeded.
+	 * The tester is calibrated for the probe, so init() must follow it.
+	 */
+	unsigned int probeAvailableWays(const CacheLine::vec& lines, unsigned int slices, unsigned int maxWays) {
+		if(lines.size() < 2) {
+			return 0;
+		}
+
+		tester.init(lines.size() + 1);
+		warmup(lines);
+
+		vector<unsigned int> probes;
+		for(unsigned int i = 0; i < WAYS_PROBE_RETRIES && probes.size() < WAYS_PROBES; i++) {
+			CacheLine::vec order(lines);
+			for(auto j = order.size(); j > 1; j--) {
+				std::swap(order[j-1], order[tester.random() % j]);
+			}
+			auto target = order.back();
+			order.pop_back();
+
+			// Each step adds about one line of each slice
+			CacheLine::vec group;
+			bool evicted = false;
+			for(auto l = order.begin(); l != order.end() && !evicted; ) {
+				for(unsigned int s = 0; s < slices && l != order.end(); s++, l++) {
+					group.push_back(*l);
+				}
+				evicted = isEvictedBy(target, group);
+			}
+			if(!evicted) {
+				continue;
+			}
+
+			for(unsigned int y = group.size(); y-- > 0; ) {
+				if(isEvictedBy(target, group, group[y])) {
+					group.erase(group.begin() + y);
+				}
+			}
+
+			VERBOSE("[WAYS] Probe: " << dec << group.size() << endl);
+			if(group.size() <= maxWays && isEvictedBy(target, group)) {
+				probes.push_back(group.size());
+			}
+		}
+
+		if(probes.empty()) {
+			return 0;
+		}
+
+		std::nth_element(probes.begin(), probes.begin() + probes.size() / 2, probes.end());
+		return probes[probes.size() / 2];
+	}
+
+	/*
+	 * Builds a conflict set of all the slices in one pass over the lines:
+	 * a line is added to the set only if the set does not evict it, so the set
+	 * ends up with the available ways of each slice. The lines the set evicts
+	 * are then used to split it into an eviction set per slice.
+	 */
+	vector<CacheLine::vec> findEvictionSetsByConflictSet(const CacheLine::vec& lines) {
+		CacheLine::vec order(lines);
+		for(auto i = order.size(); i > 1; i--) {
+			std::swap(order[i-1], order[tester.random() % i]);
+		}
+
+		VERBOSE("[CONFLICT-SET] Build");
+		CacheLine::vec conflictSet;
+		CacheLine::vec evicted;
+		for(auto l=order.begin(); l != order.end(); l++) {
+			if(conflictSet.size() >= getMaxConflictSetSize() ||
+					(conflictSet.size() >= availWays && isEvictedBy(*l, conflictSet))) {
+				evicted.push_back(*l);
+			} else {
+				conflictSet.push_back(*l);
+			}
+		}
+		VERBOSE(" (" << dec << conflictSet.size() << " lines), Split");
+
+		// Each evicted line is evicted only by the lines of its slice in the
+		// conflict set, so without any one of them it is not evicted.
+		vector<CacheLine::vec> evictionSets;
+		for(auto x=evicted.begin(); x != evicted.end() && evictionSets.size() < slicesCount; x++) {
+			if(conflictSet.size() < availWays || !isEvictedBy(*x, conflictSet)) {
+				continue;
+			}
+
+			CacheLine::vec evictionSet;
+			CacheLine::vec remaining;
+			for(auto y=conflictSet.begin(); y != conflictSet.end(); y++) {
+				if(isEvictedBy(*x, conflictSet, *y)) {
+					remaining.push_back(*y);
+				} else {
+					evictionSet.push_back(*y);
+				}
+			}
+
+			if(evictionSet.size() >= availWays) {
+				evictionSets.push_back(evictionSet);
+				conflictSet = remaining;
+			}
+		}
+		VERBOSE(" (" << dec << evictionSets.size() << " slices)");
+
+		return evictionSets;
+	}
+
+	void detectByConflictSet(const CacheLine::vec& lines) {
+		vector<CacheLine::vec> evictionSets = findEvictionSetsByConflictSet(lines);
+
+		if(evictionSets.size() < slicesCount) {
+			VERBOSE(" [FAILED] Could not find an eviction set for each slice" << endl);
+			throw NeedMoreLinesException("Could not find an eviction set for each slice");
+		}
+
+		VERBOSE(", Classify");
+		classifyAllLines(lines, evictionSets);
+	}
+
+	void classifyAllLines(const CacheLine::vec& lines, const vector<CacheLine::vec>& evictionSets) {
+		vector<unsigned int> counts = classifyLines(lines, evictionSets);
+		calibrateAccessPattern(lines, evictionSets[0], 0);
+
+		for(unsigned int curSlice=0; curSlice < slicesCount; ++curSlice) {
+			if(counts[curSlice] < linesPerSet) {
+				VERBOSE(" [FAILED] Not enough lines for each set" << endl);
+				throw NeedMoreLinesException("Not enough lines for each set");
+			}
+		}
+		VERBOSE(" [SUCCESS]" << endl);
+	}
+
+	/*
+	 * Classifies all the lines in one pass, given an eviction set for each
+	 * slice: a line is tested against the slices one by one until the first
+	 * one that evicts it twice. A line that none of the other slices evict is
+	 * confirmed against the last slice once. A line that no slice evicts
+	 * (e.g., the test did not decide) is left undetected.
+	 * Returns the number of lines in each slice.
+	 */
+	vector<unsigned int> classifyLines(const CacheLine::vec& lines, const vector<CacheLine::vec>& evictionSets) {
+		vector<unsigned int> counts(evictionSets.size(), 0);
+		if(evictionSets.empty()) {
+			return counts;
+		}
+
+		// The lines of the eviction sets are already known
+		for(unsigned int slice=0; slice < evictionSets.size(); ++slice) {
+			for(auto l=evictionSets[slice].begin(); l != evictionSets[slice].end(); l++) {
+				if((*l)->getCacheSlice() != (int)slice) {
+					(*l)->setCacheSlice(slice);
+				}
+				counts[slice] += 1;
+			}
+		}
+
+		unsigned int lastSlice = evictionSets.size() - 1;
+		for(auto line=lines.begin(); line != lines.end(); line++) {
+			if((*line)->getCacheSlice() >= 0) {
+				continue;
+			}
+
+			// A slice that evicts the line is confirmed by a second test, as a
+			// line is no longer tested against every slice
+			unsigned int slice = 0;
+			for(; slice < lastSlice; ++slice) {
+				tester.clear();
+				tester.add(evictionSets[slice], availWays);
+				if(tester.isOnSameSet(*line) && tester.isOnSameSet(*line)) {
+					break;
+				}
+			}
+
+			if(slice == lastSlice) {
+				tester.clear();
+				tester.add(evictionSets[lastSlice], availWays);
+				if(!tester.isOnSameSet(*line)) {
+					continue;
+				}
+			}
+
+			(*line)->setCacheSlice(slice);
+			counts[slice] += 1;
+		}
 
+		return counts;
 	}
 
-	static CacheLine::vec getAllUndetectedLines(const CacheLine::uset& lines) {
+	static CacheLine::vec getAllUndetectedLines(const CacheLine::vec& lines) {
 		CacheLine::vec res;
 		for(auto l = lines.begin(); l != lines.end(); ++l) {
 			if((*l)->getCacheSlice() < 0) {
@@ -337,7 +757,9 @@ public:
 		if(verbose){
 			std::cout << "[SUCCESS] "
 					  << "Hit access time: " << tester.avgHitAccessTime << " - "
-					  << "Miss access time: " << tester.avgMissAccessTime << endl;
+					  << "Miss access time: " << tester.avgMissAccessTime << " - "
+					  << "Threshold: " << tester.llcMaxAccessTime << " - "
+					  << "Hit/Miss above threshold: " << tester.hitHighRate << "/" << tester.missHighRate << endl;
 		}
 
 		didWarmup = true;
@@ -0,0 +1,123 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_SLICEHASH_HPP_
+#define PLUMBER_SLICEHASH_HPP_
+
+#include <atomic>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// The slice hash only uses the physical address bits from this bit and up,
+// so all the lines of such an aligned block are in the same slice.
+// The allocator may use larger or smaller blocks (see blockShift).
+#define SLICE_BLOCK_SHIFT 16
+#define SLICE_HASH_MAX_BIT 48
+// A kernel vector is kept only if this many samples differ from the first
+// sample of their class by it. At-most this many differences are counted.
+#define SLICE_HASH_MIN_SUPPORT 3
+#define SLICE_HASH_MAX_PAIRS (1UL<<22)
+
+/*
+ * Learns the slice hash from lines with detected slices.
+ *
+ * The hash is modeled as a lookup table of a linear (XOR) function of the
+ * address bits. Any two addresses whose difference is in the kernel of the
+ * linear function are in the same slice.
+ *
+ * The kernel is built by Gaussian elimination over GF(2) from the
+ * differences of addresses in the same slice. A difference is accepted only
+ * if the kernel stays consistent with all the samples, so two addresses of
+ * different slices never reduce to the same value. It is accepted once
+ * several pairs of samples share it, if there are enough samples, and a
+ * kernel vector is kept only if several samples are joined by it, so sparse
+ * samples do not merge two values of the function that map to the same
+ * slice. The learned hash must also predict the held-out samples.
+ * Since the slice count may not be a power of two (e.g., 12 slices), a slice
+ * may span several values of the function, so each slice keeps a reference
+ * address per value.
+ * Values that were never seen have no known slice, and neither have
+ * addresses that differ from the samples in a bit that never varied in them.
+ */
+class SliceHash {
+	// The hashed bits: from the block shift up
+	unsigned int blockShift;
+	unsigned long mask;
+
+	// Row-echelon basis of the kernel, by pivot bit
+	unsigned long basis[SLICE_HASH_MAX_BIT];
+	unsigned int rank;
+
+	// The bits that varied in the samples, and the value of the others
+	unsigned long observed;
+	unsigned long reference;
+
+	vector<pair<unsigned long, int>> samples;
+
+	// The XOR functions that are orthogonal to the kernel, for reporting
+	vector<unsigned long> functions;
+	unordered_map<unsigned long, int> table;
+	// May be forgotten while other threads look up slices
+	atomic<bool> learned;
+
+public:
+	SliceHash(unsigned int blockShift = SLICE_BLOCK_SHIFT);
+
+	// Forgets the samples, and hashes from another block shift
+	void reset(unsigned int blockShift);
+
+	void add(unsigned long physcialAddr, int slice);
+	// Learns from all but the last heldOut samples, which the learned hash
+	// must then predict
+	bool learn(unsigned long heldOut);
+	void forget() { learned = false; }
+
+	bool isLearned() const { return learned; }
+	unsigned long getSamplesCount() const { return samples.size(); }
+	unsigned int getFunctionsCount() const { return functions.size(); }
+	unsigned long getTableSize() const { return table.size(); }
+	unsigned long getObservedBits() const { return observed; }
+
+	// The slice of the address, or -1 if it is not known
+	int getSlice(unsigned long physcialAddr) const;
+
+	void print() const;
+
+private:
+	// The unique representative of the address modulo the kernel
+	static unsigned long reduce(const unsigned long* basis, unsigned long physcialAddr);
+	static bool insert(unsigned long* basis, unsigned long diff);
+	// Whether extending the kernel by diff keeps the classes of different
+	// slices apart. The classes are reduced by the current kernel.
+	static bool isConsistent(const unordered_map<unsigned long, int>& classes, unsigned long diff);
+	typedef vector<pair<unsigned long, int>>::const_iterator SampleIter;
+	// Learns the kernel from the samples up to learnedEnd, by the differences
+	// that at-least minSupport pairs of classes share. Whether any was learned.
+	bool learnKernel(SampleIter learnedEnd, unsigned int minSupport);
+	bool predictsHeldOut(SampleIter learnedEnd) const;
+	// The pivot of the least supported kernel vector, if it lacks support
+	// (-1: all the vectors are supported)
+	int findUnsupported(SampleIter learnedEnd) const;
+	int lookup(unsigned long physcialAddr) const;
+	void calculateFunctions();
+};
+
+#endif /* PLUMBER_SLICEHASH_HPP_ */
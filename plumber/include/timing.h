@@ -143,4 +143,106 @@ static __inline__ unsigned long long rdtsc(void)
 
 #endif
 
+/*
+ * The timer that measures a single access.
+ * Each backend is calibrated at startup (see calibrateTimers()), and the one
+ * with the least overhead, among those that separate a hit from a miss, is
+ * used. The units depend on the backend: cycles, counter ticks or nanoseconds.
+ */
+enum TimerBackend {
+	RDTSCP_TIMER,			// rdtscp+lfence: the access is serialized between the reads
+	RDTSC_TIMER,			// rdtsc with an mfence after the access
+	COUNTER_THREAD_TIMER,	// A thread spinning on a shared counter, for VMs that trap rdtsc
+	MONOTONIC_RAW_TIMER,	// clock_gettime(CLOCK_MONOTONIC_RAW), in nanoseconds
+	TIMER_BACKENDS_COUNT
+};
+
+struct TimerCalibration {
+	bool available;
+	double overhead;		// Median time of an empty measurement
+	double deviation;		// Standard deviation of an empty measurement
+	double missTime;		// Median time of a miss
+	double separation;		// Median miss time minus median hit time
+	bool reliable;
+};
+
+extern TimerBackend g_timerBackend;
+extern volatile unsigned long long g_timerCounter;
+
+const char* getTimerName(TimerBackend backend);
+bool setTimerBackend(const char* name);
+TimerBackend calibrateTimers(bool verbose);
+TimerCalibration calibrateTimer(TimerBackend backend);
+// Stops the counter thread, if it runs
+void stopTimers();
+// The CPU of the counter thread, which must not measure, or -1
+int getTimerCpu();
+// The bins of a latency histogram that covers the misses in the timer's units
+unsigned int getTimerHistogramBins();
+
+#if defined(__i386__) || defined(__x86_64__)
+inline void lfence() __attribute__((always_inline));
+inline void lfence() {
+  asm volatile("lfence");
+}
+
+inline unsigned long long rdtscp() __attribute__((always_inline));
+inline unsigned long long rdtscp() {
+  unsigned int lo, hi, aux;
+  __asm__ __volatile__ ("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+  return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
+}
+#endif
+
+inline unsigned long long monotonicRawNs() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Read the timer before the measured access
+inline unsigned long long timerStart() __attribute__((always_inline));
+inline unsigned long long timerStart() {
+	switch(g_timerBackend) {
+#if defined(__i386__) || defined(__x86_64__)
+	case RDTSCP_TIMER: {
+		lfence();
+		unsigned long long t = rdtsc();
+		lfence();
+		return t;
+	}
+#endif
+	case COUNTER_THREAD_TIMER:
+		mfence();
+		return g_timerCounter;
+	case MONOTONIC_RAW_TIMER:
+		return monotonicRawNs();
+	default:
+		return rdtsc();
+	}
+}
+
+// Read the timer after the measured access completed
+inline unsigned long long timerEnd() __attribute__((always_inline));
+inline unsigned long long timerEnd() {
+	switch(g_timerBackend) {
+#if defined(__i386__) || defined(__x86_64__)
+	case RDTSCP_TIMER: {
+		unsigned long long t = rdtscp();
+		lfence();
+		return t;
+	}
+#endif
+	case COUNTER_THREAD_TIMER:
+		mfence();
+		return g_timerCounter;
+	case MONOTONIC_RAW_TIMER:
+		mfence();
+		return monotonicRawNs();
+	default:
+		mfence();
+		return rdtsc();
+	}
+}
+
 #endif /* PLUMBER_TIMING_H_ */
@@ -0,0 +1,39 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef PLUMBER_TOPOLOGY_H_
+#define PLUMBER_TOPOLOGY_H_
+
+#include <vector>
+
+using namespace std;
+
+unsigned int getSocketsCount();
+vector<int> getSocketCpus(int socket);
+int getCpuSocket(int cpu);
+int getCpuNode(int cpu);
+int getSocketNode(int socket);
+
+// One CPU of each physical core of the given CPUs
+vector<int> getPhysicalCoreCpus(const vector<int>& cpus);
+// The given CPUs that are not on the physical core of the CPU (all of them if it is -1)
+vector<int> getOtherCoresCpus(const vector<int>& cpus, int cpu);
+
+bool pinThreadToCpus(const vector<int>& cpus);
+
+#endif /* PLUMBER_TOPOLOGY_H_ */
@@ -16,56 +16,191 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include "ObjectPoll.h"
 
-ObjectPoll::ObjectPoll(unsigned long objectSize, unsigned long pollSize) : objectSize(objectSize),  pollSize(pollSize) {
-	poll = (char*) mmap(0, pollSize, PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#define NODE_MASK_BITS (sizeof(unsigned long) * 8)
+
+ObjectPoll::ObjectPoll(unsigned long objectSize, unsigned long pollSize, bool hugePages,
+		const char* backingFile, bool shared) :
+		objectSize(objectSize),  pollSize(pollSize), hugePages(hugePages),
+		backingFile(backingFile == NULL ? "" : backingFile), backingFd(-1),
+		persistent(backingFile != NULL), translator(NULL) {
+	pageSize = hugePages ? HUGE_PAGE_SIZE : PAGE_SIZE;
+	if (backingFile != NULL) {
+		mapBackingFile();
+	} else if (shared) {
+		mapSharedMemory();
+	} else {
+		mapPoll();
+	}
 
-	if (PAGE_MASK(poll) != 0) {
+	if (PTR_TO_ADDR(poll) % pageSize != 0) {
 		throw ObjectPollException("Not page aligned");
 	}
 
-	pollGCPos = poll;
 	pollPos = poll;
 	pollEnd = poll + pollSize / sizeof(*poll);
 
+	objectPos = NULL;
+	objectEnd = NULL;
+
 	usePageOffset = false;
 	pageOffset = 0;
-	freedPages = 0;
+
+	pagemap = new PageMap(poll, pollSize);
 }
 
 ObjectPoll::~ObjectPoll() {
-	freeArea(poll, pollSize);
+	delete pagemap;
+	if (isShared()) {
+		// Only the mapping is dropped: a file keeps the pages for the next run,
+		// and a shared memfd frees them with its last descriptor or mapping
+		// (which may be of another process that still uses the poll)
+		munmap(poll, pollSize);
+		close(backingFd);
+	} else {
+		freeArea(poll, pollSize);
+	}
+}
+
+void ObjectPoll::mapBackingFile() {
+	backingFd = open(backingFile.c_str(), O_RDWR | O_CREAT, 0600);
+	if (backingFd < 0) {
+		throw ObjectPollException("Failed to open poll file");
+	}
+
+	if (ftruncate(backingFd, pollSize) != 0) {
+		close(backingFd);
+		throw ObjectPollException("Failed to resize poll file");
+	}
+
+	poll = (char*) mmap(0, pollSize, PROT_READ | PROT_WRITE, MAP_SHARED, backingFd, 0);
+	if (poll == MAP_FAILED) {
+		close(backingFd);
+		throw ObjectPollException("Failed to map poll file");
+	}
+}
+
+void ObjectPoll::mapSharedMemory() {
+	backingFd = memfd_create("plumber-poll", MFD_ALLOW_SEALING | (hugePages ? MFD_HUGETLB : 0));
+	if (backingFd < 0) {
+		throw ObjectPollException("Failed to create shared poll");
+	}
+
+	// Sealing the size lets other processes map the whole poll safely
+	if (ftruncate(backingFd, pollSize) != 0
+			|| fcntl(backingFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+		close(backingFd);
+		throw ObjectPollException("Failed to seal shared poll");
+	}
+
+	poll = (char*) mmap(0, pollSize, PROT_READ | PROT_WRITE, MAP_SHARED, backingFd, 0);
+	if (poll == MAP_FAILED) {
+		close(backingFd);
+		throw ObjectPollException("Failed to map shared poll");
+	}
+
+	backingFile = "/proc/" + to_string(getpid()) + "/fd/" + to_string(backingFd);
+}
+
+void ObjectPoll::mapPoll() {
+	if (!hugePages) {
+		poll = (char*) mmap(0, pollSize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		// The huge pages are reserved on mapping (no MAP_NORESERVE), so a poll
+		// that is bigger than the huge pages pool falls back instead of failing
+		// later on access.
+		poll = (char*) mmap(0, pollSize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (poll == MAP_FAILED) {
+			// Fallback to transparent huge pages: align the poll to a huge page
+			// and let the kernel back it with huge pages.
+			auto area = (char*) mmap(0, pollSize + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (area != MAP_FAILED) {
+				poll = area + (HUGE_PAGE_SIZE - PTR_TO_ADDR(area) % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+				if (poll != area) {
+					munmap(area, poll - area);
+				}
+				munmap(poll + pollSize, area + HUGE_PAGE_SIZE - poll);
+				madvise(poll, pollSize, MADV_HUGEPAGE);
+			} else {
+				poll = area;
+			}
+		}
+	}
+
+	if (poll == MAP_FAILED) {
+		throw ObjectPollException("Failed to map poll");
+	}
 }
 
 void ObjectPoll::freeArea(void* p, unsigned long size) {
+	// Locked pages cannot be discarded
+	munlock(p, size);
 	madvise(p, size, MADV_DONTNEED);
+
+	if (isShared()) {
+		// Discarding a shared mapping only unmaps it, the file keeps the pages
+		fallocate(backingFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offsetOf(p), size);
+	}
+}
+
+void ObjectPoll::restore(unsigned long usedSize) {
+	lock_guard<recursive_mutex> lock(pollMutex);
+
+	if (usedSize > pollSize) {
+		throw ObjectPollException("Restored size is bigger than the poll");
+	}
+
+	pollPos = poll + (usedSize + pageSize - 1) / pageSize * pageSize;
+	objectPos = NULL;
+	objectEnd = NULL;
+	freePages.clear();
+
+	auto pages = pageIndex(pollPos);
+	pageLiveObjects.assign(pages, 0);
+	pageReleased.assign(pages, false);
+
+	gcPages.clear();
+	for (char* page = poll; page < pollPos; page += pageSize) {
+		gcPages.push_back(page);
+	}
+
+	mlock(poll, pollPos - poll);
 }
 
 void ObjectPoll::GC() {
-	for (char* pollIter = pollGCPos; pollIter < pollPos; pollIter += PAGE_SIZE) {
-		auto buff = reinterpret_cast<unsigned long*>(pollIter);
-		bool isCleared = true;
-
-		for (unsigned int i = 0; i < PAGE_SIZE / sizeof(*buff); ++i) {
-			if (buff[i] != 0) {
-				isCleared = false;
-				break;
-			}
-		}
+	lock_guard<recursive_mutex> lock(pollMutex);
 
-		if (isCleared) {
-			freeArea(pollIter, PAGE_SIZE);
-			freedPages += 1;
+	// Pages are released as soon as their last object is deleted, so only
+	// pages that were never claimed are left to collect. A page that was
+	// reused from the free pages is tracked as well, even if it is below
+	// pages that were already collected.
+	char* objectPage = objectPos == NULL ? NULL : pageFrame(objectPos - 1);
+	vector<char*> pending;
+	for (auto page : gcPages) {
+		auto index = pageIndex(page);
+		if (page == objectPage) {
+			pending.push_back(page);
+		} else if (!pageReleased[index] && pageLiveObjects[index] == 0) {
+			releasePage(page);
 		}
 	}
 
-	pollGCPos = reinterpret_cast<char*>(PAGE_FRAME_MASK(pollPos));
+	gcPages.swap(pending);
 }
 
 unsigned long ObjectPoll::getTotalAllocatedPoll() {
-	return PTR_TO_ADDR(pollPos) - PTR_TO_ADDR(poll) - freedPages * PAGE_SIZE;
+	return PTR_TO_ADDR(pollPos) - PTR_TO_ADDR(poll) - freePages.size() * pageSize;
 }
 
 void ObjectPoll::setPageOffset(void* p) {
@@ -78,62 +213,154 @@ void ObjectPoll::setPageOffset(void* p) {
 	}
 }
 
+void ObjectPoll::claimObject(void *p) {
+	lock_guard<recursive_mutex> lock(pollMutex);
+	pageLiveObjects[pageIndex(p)] += 1;
+}
+
 void ObjectPoll::deleteObject(void *p) {
 	memset(p, 0, objectSize);
+
+	lock_guard<recursive_mutex> lock(pollMutex);
+	auto index = pageIndex(p);
+	if (pageLiveObjects[index] > 0 && --pageLiveObjects[index] == 0) {
+		releasePage(pageFrame(reinterpret_cast<char*>(p)));
+	}
 }
 
 void* ObjectPoll::newObject() {
-	if (pollPos+objectSize > pollEnd) {
-		throw ObjectPollException("Out of Poll");
-	}
+	lock_guard<recursive_mutex> lock(pollMutex);
 
-//		if(PAGE_MASK(pollPos) == 0) {
-//			if(PTR_TO_ADDR(pollPos) >= 0x00800000000L) {
-//				memset((ptr)pollPos, 0, PAGE_SIZE);
-//				pollPos += PAGE_SIZE/LINE_SIZE;
-//			}
-//		}
+	if (objectPos == NULL || objectPos + objectSize > objectEnd) {
+		objectPos = reinterpret_cast<char*>(newPage());
+		objectEnd = objectPos + pageSize;
+	}
 
 	if (usePageOffset) {
-		unsigned int curOffset = PAGE_MASK(pollPos);
-		while (curOffset != pageOffset) {
-			deleteObject(pollPos);
-			pollPos += objectSize;
-			curOffset = PAGE_MASK(pollPos);
+		while (PAGE_MASK(objectPos) != pageOffset) {
+			objectPos += objectSize;
+		}
+
+		if (objectPos + objectSize > objectEnd) {
+			objectPos = NULL;
+			return newObject();
 		}
 	}
 
-	auto ret = pollPos;
-	pollPos += objectSize;
+	auto ret = objectPos;
+	objectPos += objectSize;
+	claimObject(ret);
 
 	return ret;
 }
 
-unsigned long ObjectPoll::calculatePhyscialAddr(void* ptr) {
-	// https://shanetully.com/2014/12/translating-virtual-addresses-to-physcial-addresses-in-user-space/
+void* ObjectPoll::newPage(int node) {
+	lock_guard<recursive_mutex> lock(pollMutex);
+
+	char* page;
+	if (!freePages.empty()) {
+		page = freePages.back();
+		freePages.pop_back();
+		pageReleased[pageIndex(page)] = false;
+	} else {
+		page = pageFrame(pollPos + pageSize - 1);
+		if (page + pageSize > pollEnd) {
+			throw ObjectPollException("Out of Poll");
+		}
+
+		pollPos = page + pageSize;
+
+		auto index = pageIndex(page);
+		if (index >= pageLiveObjects.size()) {
+			pageLiveObjects.resize(index + 1, 0);
+			pageReleased.resize(index + 1, false);
+		}
+	}
+
+	pageLiveObjects[pageIndex(page)] = 0;
+	gcPages.push_back(page);
+
+	if (node >= 0 && (unsigned long)node < NODE_MASK_BITS) {
+		unsigned long nodeMask = 1UL << node;
+		if (syscall(SYS_mbind, page, pageSize, MPOL_BIND, &nodeMask, NODE_MASK_BITS + 1, 0) != 0) {
+			throw ObjectPollException("Failed to bind page to NUMA node");
+		}
+	}
+
+	// Locking the page also faults it in, so the page frame is already
+	// populated when it is translated.
+	mlock(page, pageSize);
 
-	unsigned long virtAddress = reinterpret_cast<unsigned long>(ptr);
-	unsigned long pageOffset = virtAddress % PAGE_SIZE;
+	return page;
+}
 
-	// Open the pagemap file for the current process
-	FILE *pagemap = fopen("/proc/self/pagemap", "rb");
+void ObjectPoll::releasePage(void* p) {
+	lock_guard<recursive_mutex> lock(pollMutex);
 
-	// Seek to the page that the buffer is on
-	unsigned long pageTableOffset = (virtAddress / PAGE_SIZE) * PAGEMAP_LENGTH;
-	if (fseek(pagemap, pageTableOffset, SEEK_SET) != 0) {
-		throw ObjectPollException("Failed to seek pagemap to proper location");
+	auto page = reinterpret_cast<char*>(p);
+	auto index = pageIndex(page);
+	if (pageReleased[index]) {
+		return;
 	}
 
-	// The page frame number is in bits 0-54 so read the first 7 bytes and clear the 55th bit
-	unsigned long page_frame_number = 0;
-	if (fread(&page_frame_number, 1, PAGEMAP_LENGTH - 1, pagemap)
-			!= PAGEMAP_LENGTH - 1) {
-		throw ObjectPollException("Failed to read page frame number");
+	if (objectPos != NULL && pageFrame(objectPos - 1) == page) {
+		objectPos = NULL;
+		objectEnd = NULL;
 	}
 
-	fclose(pagemap);
+	freeArea(page, pageSize);
+	pagemap->invalidate(page, pageSize >> PAGE_SHIFT);
 
-	page_frame_number &= 0x7FFFFFFFFFFFFF;
+	pageLiveObjects[index] = 0;
+	pageReleased[index] = true;
+	freePages.push_back(page);
+}
+
+int ObjectPoll::getPageNode(void* page) {
+	int node = -1;
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, page, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+		return -1;
+	}
 
-	return (page_frame_number << PAGE_SHIFT) | pageOffset;
+	return node;
+}
+
+unsigned long ObjectPoll::calculatePhyscialAddr(void* ptr) {
+	lock_guard<recursive_mutex> lock(pollMutex);
+	if(translator != NULL) {
+		return translator->translate(ptr);
+	}
+	return pagemap->translate(ptr);
+}
+
+unsigned long ObjectPoll::translatePage(void* page) {
+	lock_guard<recursive_mutex> lock(pollMutex);
+	if(translator != NULL) {
+		return translator->translate(page);
+	}
+
+	// The page might have been re-populated, so it is always read again.
+	// All the base pages of a huge page are read at once.
+	pagemap->load(page, pageSize >> PAGE_SHIFT);
+	return pagemap->translate(page);
+}
+
+bool ObjectPoll::isPhysicallyContiguous(void* page) {
+	lock_guard<recursive_mutex> lock(pollMutex);
+	if(translator != NULL) {
+		return false;
+	}
+
+	// Transparent huge pages might fall back to base pages, so a huge page is
+	// only trusted if it is backed by a single aligned physical huge page.
+	return pagemap->isContiguous(page, pageSize >> PAGE_SHIFT)
+			&& pagemap->translate(page) % pageSize == 0;
+}
+
+unsigned long ObjectPoll::refreshTranslation(vector<unsigned long>& pageNumbers) {
+	lock_guard<recursive_mutex> lock(pollMutex);
+	if(translator != NULL) {
+		return 0;
+	}
+	return pagemap->refresh(pageNumbers);
 }
@@ -0,0 +1,154 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "PageMap.h"
+#include "ObjectPoll.h"
+
+// https://www.kernel.org/doc/Documentation/vm/pagemap.txt
+#define PAGEMAP_PFN_MASK ((1UL<<55) - 1)
+
+// Pages that are closer than this are read in one pread(), including the gap
+#define PAGEMAP_MAX_GAP 64
+
+PageMap::PageMap(const void* base, unsigned long size) :
+		basePage(PTR_TO_ADDR(base) >> PAGE_SHIFT), pagesCount(size >> PAGE_SHIFT) {
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		throw PageMapException("Failed to open pagemap");
+	}
+}
+
+PageMap::~PageMap() {
+	close(fd);
+}
+
+bool PageMap::isCached(unsigned long page) const {
+	return page >= basePage && page - basePage < entries.size()
+			&& entries[page - basePage] != 0;
+}
+
+unsigned long& PageMap::entry(unsigned long page) {
+	return entries[page - basePage];
+}
+
+void PageMap::reserve(unsigned long lastPage) {
+	if (lastPage - basePage >= entries.size()) {
+		entries.resize(lastPage - basePage + 1, 0);
+	}
+}
+
+void PageMap::read(unsigned long firstPage, unsigned long pages, unsigned long* buffer) {
+	auto length = pages * PAGEMAP_LENGTH;
+	auto readLength = pread(fd, buffer, length, firstPage * PAGEMAP_LENGTH);
+	if (readLength < 0 || (unsigned long)readLength != length) {
+		throw PageMapException("Failed to read page frame numbers");
+	}
+}
+
+unsigned long PageMap::translate(const void* ptr) {
+	unsigned long virtAddress = PTR_TO_ADDR(ptr);
+	unsigned long page = virtAddress >> PAGE_SHIFT;
+
+	unsigned long pageEntry;
+	if (isCached(page)) {
+		pageEntry = entry(page);
+	} else if (page >= basePage && page - basePage < pagesCount) {
+		load(ptr, 1);
+		pageEntry = entry(page);
+	} else {
+		read(page, 1, &pageEntry);
+	}
+
+	return ((pageEntry & PAGEMAP_PFN_MASK) << PAGE_SHIFT) | (virtAddress % PAGE_SIZE);
+}
+
+void PageMap::load(const void* begin, unsigned long pages) {
+	unsigned long firstPage = PTR_TO_ADDR(begin) >> PAGE_SHIFT;
+	if (firstPage < basePage || firstPage - basePage + pages > pagesCount) {
+		throw PageMapException("Range is outside of the mapped region");
+	}
+
+	reserve(firstPage + pages - 1);
+	read(firstPage, pages, &entry(firstPage));
+}
+
+bool PageMap::isContiguous(const void* begin, unsigned long pages) {
+	unsigned long firstPage = PTR_TO_ADDR(begin) >> PAGE_SHIFT;
+	if (!isCached(firstPage)) {
+		load(begin, pages);
+	}
+
+	unsigned long firstFrame = entry(firstPage) & PAGEMAP_PFN_MASK;
+	for (unsigned long i = 1; i < pages; ++i) {
+		if (!isCached(firstPage + i) || (entry(firstPage + i) & PAGEMAP_PFN_MASK) != firstFrame + i) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+unsigned long PageMap::refresh(vector<unsigned long>& pageNumbers) {
+	std::sort(pageNumbers.begin(), pageNumbers.end());
+	pageNumbers.erase(std::unique(pageNumbers.begin(), pageNumbers.end()), pageNumbers.end());
+
+	unsigned long changed = 0;
+	vector<unsigned long> buffer;
+
+	for (auto it = pageNumbers.begin(); it != pageNumbers.end();) {
+		// Coalesce close pages to a single read
+		auto runEnd = it + 1;
+		while (runEnd != pageNumbers.end() && *runEnd - *(runEnd - 1) <= PAGEMAP_MAX_GAP) {
+			++runEnd;
+		}
+
+		unsigned long firstPage = *it;
+		unsigned long pages = *(runEnd - 1) - firstPage + 1;
+		buffer.resize(pages);
+		read(firstPage, pages, buffer.data());
+
+		for (; it != runEnd; ++it) {
+			unsigned long newEntry = buffer[*it - firstPage];
+			if (*it < basePage || *it - basePage >= pagesCount) {
+				continue;
+			}
+
+			reserve(*it);
+			unsigned long& oldEntry = entry(*it);
+			if (oldEntry != 0 && (oldEntry & PAGEMAP_PFN_MASK) != (newEntry & PAGEMAP_PFN_MASK)) {
+				changed += 1;
+			}
+			oldEntry = newEntry;
+		}
+	}
+
+	return changed;
+}
+
+void PageMap::invalidate(const void* begin, unsigned long pages) {
+	unsigned long firstPage = PTR_TO_ADDR(begin) >> PAGE_SHIFT;
+	for (unsigned long page = firstPage; page < firstPage + pages; ++page) {
+		if (isCached(page)) {
+			entry(page) = 0;
+		}
+	}
+}
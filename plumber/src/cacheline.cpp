@@ -18,46 +18,22 @@
  */
 #include "cacheline.hpp"
 
-ObjectPoll* CacheLine::poll;
 map<unsigned long, unsigned int> CacheLine::oldAddressMap;
 int CacheLine::pollute_dummy;
 
-CacheLine::CacheLine(unsigned int lineSize, unsigned int _inSliceSetCount) {
-	if (sizeof(*this) > lineSize) {
+CacheLine::CacheLine(LineTable* table, LineTable::id lineId) : next(NULL), table(table), lineId(lineId) {
+	if (sizeof(*this) > table->getLineSize()) {
 		throw CacheLineException(this, "Object is bigger then line size");
 	}
 
 	unsigned long virtualAddress = PTR_TO_ADDR(this);
-	if (virtualAddress % lineSize != 0) {
+	if (virtualAddress % table->getLineSize() != 0) {
 		throw CacheLineException(this, "Not aligned to line size");
 	}
-
-	mlock(this, sizeof(*this));
-
-	unsigned int roundedSetCount;
-	for (roundedSetCount=1; roundedSetCount<_inSliceSetCount; roundedSetCount*=2 );
-	if(roundedSetCount != _inSliceSetCount) {
-		throw CacheLineException(this, "In slice set count must be a power of 2");
-	}
-
-	next = NULL;
-	physcialAddr = calculatePhyscialAddr();
-
-	lineRelativePhyscialAddress = physcialAddr / lineSize;
-
-	inSliceSetCount = _inSliceSetCount;
-	cacheSlice = -1;
-
-	calculateSet();
-}
-
-void CacheLine::calculateSet() {
-	lineSet = getInSliceSet()
-		| (cacheSlice < 0 ? 0 : (cacheSlice * inSliceSetCount));
 }
 
 void CacheLine::validatePhyscialAddr() const {
-	if(physcialAddr != calculatePhyscialAddr()) {
+	if(getPhysicalAddr() != calculatePhyscialAddr()) {
 		CacheLineException(this, "Physical address changed!");
 	}
 }
@@ -65,6 +41,14 @@ void CacheLine::validatePhyscialAddr() const {
 void CacheLine::validateAll() const {
 	const CacheLine* curLine = this;
 
+	vector<unsigned long> pageNumbers;
+	do {
+		pageNumbers.push_back(PTR_TO_ADDR(curLine) >> PAGE_SHIFT);
+		curLine = curLine->getNext();
+	} while(curLine != this);
+
+	table->getPoll()->refreshTranslation(pageNumbers);
+
 	do {
 		curLine->validatePhyscialAddr();
 		curLine = curLine->getNext();
@@ -72,23 +56,21 @@ void CacheLine::validateAll() const {
 }
 
 void CacheLine::setCacheSlice(unsigned long _cacheSlice) {
+	int cacheSlice = getCacheSlice();
 	if(cacheSlice < 0){ // || cacheSlice == cacheSlice) {
-		cacheSlice = (int)_cacheSlice;
+		table->setCacheSlice(lineId, (int)_cacheSlice);
 	} else {
 		throw CacheSliceResetException(this, cacheSlice, cacheSlice);
 	}
-
-	calculateSet();
 }
 
 void CacheLine::resetCacheSlice() {
-	cacheSlice = -1;
-	calculateSet();
+	table->setCacheSlice(lineId, -1);
 }
 
 
 unsigned long CacheLine::calculatePhyscialAddr() const {
-	return ObjectPoll::calculatePhyscialAddr((void*)this);
+	return table->getPoll()->calculatePhyscialAddr((void*)this);
 }
 
 /*********************************************************************************************
@@ -127,44 +109,11 @@ void CacheLine::polluteSets(CacheLine::arr partitionsArray, unsigned long partit
 /*********************************************************************************************
  * Poll Control
  *********************************************************************************************/
-void CacheLine::allocatePoll(unsigned int setLineSize) {
-	if(poll == NULL) {
-		poll = new ObjectPoll(setLineSize, POLL_SIZE);
-	}
+void CacheLine::operator delete(__attribute__((unused)) void *p, __attribute__((unused)) void* place) {
 }
 
-void CacheLine::GC() {
-	if(poll != NULL) {
-		poll->GC();
-	}
-}
-
-unsigned long CacheLine::getTotalAllocatedPoll() {
-	if(poll != NULL) {
-		return poll->getTotalAllocatedPoll();
-	}
-
-	return 0;
-}
-
-void CacheLine::setPageOffset(ptr p) {
-	if(poll != NULL) {
-		poll->setPageOffset(p);
-	}
-}
-
-void CacheLine::operator delete(void *p) {
-	if(poll != NULL) {
-		poll->deleteObject(p);
-	}
-}
-
-void* CacheLine::operator new(__attribute__((unused)) size_t size) {
-	if(poll == NULL) {
-		return NULL;
-	}
-
-	return poll->newObject();
+void* CacheLine::operator new(__attribute__((unused)) size_t size, void* place) {
+	return place;
 }
 
 /*********************************************************************************************
@@ -304,7 +253,7 @@ unsigned int CacheLine::get_cache_slice() {
 unsigned int CacheLine::getHashValue(const int *bits, unsigned int bitsCount) {
 	unsigned int hash = 0;
 	for (unsigned int i = 0; i < bitsCount; i++) {
-		hash ^= (unsigned int) ((physcialAddr >> bits[i]) & 1);
+		hash ^= (unsigned int) ((getPhysicalAddr() >> bits[i]) & 1);
 	}
 
 	return hash;
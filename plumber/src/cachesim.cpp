@@ -0,0 +1,346 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include "cachesim.hpp"
+
+CacheSimConfig::CacheSimConfig() :
+		lineSize(64), setsPerSlice(2048), ways(20), slices(8),
+		hash(XOR_HASH), policy(QLRU_POLICY), catMask(0),
+		hitLatency(40), missLatency(200), jitter(10), outlierRate(0.001), outlierLatency(5000),
+		physicalBits(36), seed(1) {
+}
+
+static bool isPowerOf2(unsigned long x) {
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+CacheSimConfig CacheSimConfig::parse(const char* spec) {
+	CacheSimConfig config;
+
+	stringstream ss(spec);
+	string item;
+	while(getline(ss, item, ',')) {
+		if(item.empty()) {
+			continue;
+		}
+
+		auto eq = item.find('=');
+		if(eq == string::npos) {
+			throw CacheSimException("Simulator option must be key=value: " + item);
+		}
+		string key = item.substr(0, eq);
+		string value = item.substr(eq + 1);
+		unsigned long number = strtoul(value.c_str(), NULL, 0);
+
+		if(key == "line") {
+			config.lineSize = number;
+		} else if(key == "sets") {
+			config.setsPerSlice = number;
+		} else if(key == "ways") {
+			config.ways = number;
+		} else if(key == "slices") {
+			config.slices = number;
+		} else if(key == "hash") {
+			if(value == "xor") {
+				config.hash = XOR_HASH;
+			} else if(value == "table") {
+				config.hash = TABLE_HASH;
+			} else {
+				throw CacheSimException("Unknown simulator hash: " + value);
+			}
+		} else if(key == "policy") {
+			if(value == "lru") {
+				config.policy = LRU_POLICY;
+			} else if(value == "qlru") {
+				config.policy = QLRU_POLICY;
+			} else if(value == "random") {
+				config.policy = RANDOM_POLICY;
+			} else {
+				throw CacheSimException("Unknown simulator policy: " + value);
+			}
+		} else if(key == "cat") {
+			config.catMask = number;
+		} else if(key == "hit") {
+			config.hitLatency = number;
+		} else if(key == "miss") {
+			config.missLatency = number;
+		} else if(key == "jitter") {
+			config.jitter = number;
+		} else if(key == "outliers") {
+			config.outlierRate = atof(value.c_str());
+		} else if(key == "outlier-latency") {
+			config.outlierLatency = number;
+		} else if(key == "physical-bits") {
+			config.physicalBits = number;
+		} else if(key == "seed") {
+			config.seed = number;
+		} else {
+			throw CacheSimException("Unknown simulator option: " + key);
+		}
+	}
+
+	if(!isPowerOf2(config.lineSize) || !isPowerOf2(config.setsPerSlice)) {
+		throw CacheSimException("Simulated line size and sets must be powers of 2");
+	}
+	if(config.ways == 0 || config.ways > 64 || config.slices == 0) {
+		throw CacheSimException("Simulated ways must be 1-64 and slices at-least 1");
+	}
+	if(config.hash == XOR_HASH && !isPowerOf2(config.slices)) {
+		throw CacheSimException("The XOR hash needs a power of 2 slices");
+	}
+	unsigned long allWays = config.ways == 64 ? ~0UL : (1UL << config.ways) - 1;
+	if(config.catMask == 0) {
+		config.catMask = allWays;
+	}
+	if((config.catMask & allWays) == 0) {
+		throw CacheSimException("The CAT mask has no ways of the cache");
+	}
+	config.catMask &= allWays;
+
+	return config;
+}
+
+CacheSimulator::CacheSimulator(const CacheSimConfig& config) :
+		config(config), clock(0), seed(config.seed | 1) {
+	unsigned long lines = (unsigned long)config.slices * config.setsPerSlice * config.ways;
+	tags.assign(lines, 0);
+	ages.assign(lines, 0);
+
+	unsigned int lowBit = __builtin_ctzl((unsigned long)config.lineSize * config.setsPerSlice);
+	if(config.physicalBits <= lowBit + 8 || config.physicalBits > 48) {
+		throw CacheSimException("Not enough simulated physical address bits");
+	}
+
+	unsigned int functions = 0;
+	while((1U << functions) < config.slices) {
+		functions += 1;
+	}
+	if(config.hash == CacheSimConfig::TABLE_HASH) {
+		functions += 2;
+	}
+
+	// Random independent parities of the frame bits above the set index
+	unsigned long basis[64] = {0};
+	while(hashFunctions.size() < functions) {
+		unsigned long function = 0;
+		for(unsigned int bit = lowBit; bit < config.physicalBits; bit++) {
+			if(random() & 1) {
+				function |= 1UL << bit;
+			}
+		}
+
+		unsigned long reduced = function;
+		for(int bit = 63; bit >= 0 && reduced != 0; bit--) {
+			if(((reduced >> bit) & 1) && basis[bit] != 0) {
+				reduced ^= basis[bit];
+			}
+		}
+		if(reduced != 0) {
+			basis[63 - __builtin_clzl(reduced)] = reduced;
+			hashFunctions.push_back(function);
+		}
+	}
+
+	// Each slice gets the same share of the values, in random order
+	if(config.hash == CacheSimConfig::TABLE_HASH) {
+		hashTable.resize(1UL << functions);
+		for(unsigned int v = 0; v < hashTable.size(); v++) {
+			hashTable[v] = v % config.slices;
+		}
+		for(auto i = hashTable.size(); i > 1; i--) {
+			std::swap(hashTable[i-1], hashTable[random() % i]);
+		}
+	}
+
+	pthread_mutex_init(&mutex, NULL);
+}
+
+CacheSimulator::~CacheSimulator() {
+	pthread_mutex_destroy(&mutex);
+}
+
+CacheInfo CacheSimulator::getCacheInfo() const {
+	CacheInfo info;
+	info.level = 3;
+	info.setCacheType(3);
+	info.coherency_line_size = config.lineSize;
+	info.physical_line_partitions = 1;
+	info.ways_of_associativity = config.ways;
+	info.cache_slices = config.slices;
+	info.sets = config.setsPerSlice * config.slices;
+	info.total_size = (size_t)info.sets * config.ways * config.lineSize;
+	info.is_fully_associative = false;
+	info.is_self_initializing = true;
+	return info;
+}
+
+unsigned int CacheSimulator::random() {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+int CacheSimulator::getSlice(unsigned long physcialAddr) const {
+	unsigned long value = 0;
+	for(unsigned int f = 0; f < hashFunctions.size(); f++) {
+		value |= parity(physcialAddr & hashFunctions[f]) << f;
+	}
+
+	return config.hash == CacheSimConfig::TABLE_HASH ? hashTable[value] : (int)value;
+}
+
+unsigned long CacheSimulator::getInSliceSet(unsigned long physcialAddr) const {
+	return (physcialAddr / config.lineSize) % config.setsPerSlice;
+}
+
+int CacheSimulator::jittered(int latency) {
+	if(config.jitter > 0) {
+		latency += (int)(random() % (2 * config.jitter + 1)) - config.jitter;
+	}
+	if(config.outlierRate > 0 && random() < config.outlierRate * 4294967296.) {
+		latency += config.outlierLatency;
+	}
+
+	return latency;
+}
+
+unsigned long CacheSimulator::victim(unsigned long base) {
+	for(unsigned int way = 0; way < config.ways; way++) {
+		if(((config.catMask >> way) & 1) && tags[base + way] == 0) {
+			return base + way;
+		}
+	}
+
+	switch(config.policy) {
+	case CacheSimConfig::RANDOM_POLICY: {
+		unsigned int allowed = __builtin_popcountl(config.catMask);
+		unsigned int pick = random() % allowed;
+		for(unsigned int way = 0; way < config.ways; way++) {
+			if(((config.catMask >> way) & 1) && pick-- == 0) {
+				return base + way;
+			}
+		}
+		break;
+	}
+	case CacheSimConfig::QLRU_POLICY:
+		while(true) {
+			for(unsigned int way = 0; way < config.ways; way++) {
+				if(((config.catMask >> way) & 1) && ages[base + way] >= 3) {
+					return base + way;
+				}
+			}
+			for(unsigned int way = 0; way < config.ways; way++) {
+				if((config.catMask >> way) & 1) {
+					ages[base + way] += 1;
+				}
+			}
+		}
+		break;
+	default:
+		break;
+	}
+
+	unsigned long oldest = base + __builtin_ctzl(config.catMask);
+	for(unsigned int way = 0; way < config.ways; way++) {
+		if(((config.catMask >> way) & 1) && ages[base + way] < ages[oldest]) {
+			oldest = base + way;
+		}
+	}
+	return oldest;
+}
+
+int CacheSimulator::access(unsigned long physcialAddr) {
+	unsigned long tag = physcialAddr / config.lineSize + 1;
+	unsigned long base = ((unsigned long)getSlice(physcialAddr) * config.setsPerSlice
+			+ getInSliceSet(physcialAddr)) * config.ways;
+
+	clock += 1;
+	for(unsigned int way = 0; way < config.ways; way++) {
+		if(tags[base + way] == tag) {
+			ages[base + way] = config.policy == CacheSimConfig::QLRU_POLICY ? 0 : clock;
+			return jittered(config.hitLatency);
+		}
+	}
+
+	unsigned long line = victim(base);
+	tags[line] = tag;
+	ages[line] = config.policy == CacheSimConfig::QLRU_POLICY ? 2 : clock;
+	return jittered(config.missLatency);
+}
+
+void CacheSimulator::flush(unsigned long physcialAddr) {
+	unsigned long tag = physcialAddr / config.lineSize + 1;
+	unsigned long base = ((unsigned long)getSlice(physcialAddr) * config.setsPerSlice
+			+ getInSliceSet(physcialAddr)) * config.ways;
+
+	for(unsigned int way = 0; way < config.ways; way++) {
+		if(tags[base + way] == tag) {
+			tags[base + way] = 0;
+		}
+	}
+}
+
+unsigned long CacheSimulator::translate(const void* ptr) {
+	unsigned long page = PTR_TO_ADDR(ptr) >> PAGE_SHIFT;
+
+	lock();
+	auto frame = frames.find(page);
+	if(frame == frames.end()) {
+		unsigned long framesCount = 1UL << (config.physicalBits - PAGE_SHIFT);
+		unsigned long newFrame;
+		do {
+			newFrame = (((unsigned long)random() << 32) | random()) % framesCount;
+		} while(newFrame == 0 || !usedFrames.insert(newFrame).second);
+		frame = frames.insert(make_pair(page, newFrame)).first;
+	}
+	unsigned long physcialAddr = (frame->second << PAGE_SHIFT) | (PTR_TO_ADDR(ptr) & (PAGE_SIZE - 1));
+	unlock();
+
+	return physcialAddr;
+}
+
+void CacheSimulator::polluteSets(CacheLine::arr partitionsArray, unsigned long partitionsCount,
+		volatile bool& continueFlag) {
+	continueFlag = true;
+
+	while (continueFlag) {
+		lock();
+		for(unsigned long i=0; i < partitionsCount; i++) {
+			CacheLine::ptr a = partitionsArray[i];
+			access(a->getPhysicalAddr());
+			partitionsArray[i] = a->next;
+		}
+		unlock();
+	}
+}
+
+void CacheSimulator::flushSets(CacheLine::ptr line) {
+	lock();
+	CacheLine::ptr curline = line;
+	do {
+		flush(curline->getPhysicalAddr());
+		curline = curline->getNext();
+	} while (curline != line);
+	unlock();
+}
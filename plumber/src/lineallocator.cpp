@@ -20,101 +20,525 @@
 #include "timing.h"
 
 void CacheLineAllocator::allocateAllSets() {
+	// The timing measures the LLC of the socket that runs this thread
+	if((socket >= 0 || getTimerCpu() >= 0) && !pinThreadToCpus(getMeasuringCpus())) {
+		throw LineAllocatorException("Failed to pin allocation to socket");
+	}
+
 	VERBOSE("[ALLOCATION] Init " << endl)
 	else if(printAllocationInformation) {std::cout << "Initial allocation" << endl;}
-	allocateSet(0, 2 * cacheInfo.cache_slices * linesPerSet);
-	VERBOSE("[SUCCESS] Total: " << ((double)CacheLine::getTotalAllocatedPoll() / (double)(1<<30)) << " GB" << endl);
+	fillSets(0, 2 * cacheInfo.cache_slices * linesPerSet);
+	VERBOSE("[SUCCESS] Total: " << ((double)getTotalAllocatedPoll() / (double)(1<<30)) << " GB" << endl);
+
+	if(availableWays == 0) {
+		VERBOSE("[WAYS] Probe" << endl);
+		availableWays = detector.probeAvailableWays(getSet(0), cacheInfo.cache_slices, ways);
+		if(availableWays == 0) {
+			throw LineAllocatorException("Could not probe the available ways");
+		}
+		VERBOSE("[SUCCESS] Available ways: " << dec << availableWays << endl)
+		else if(printAllocationInformation) {std::cout << "Available ways: " << availableWays << endl;}
+	}
 
 	detector.init(cacheInfo.cache_slices, availableWays, linesPerSet);
 
-	for(unsigned int curSet=0; curSet < setsPerSlice; ++curSet) {
-		VERBOSE("[SET: " << setfill(' ') << setw(5) << dec << curSet << "] ");
-		detector.restartRuns();
-		auto& setLines = getSet(curSet);
+	if(detectionWorkers > 1) {
+		detectAllSetsInParallel();
+	} else {
+		for(unsigned int curSet=0; curSet < setsPerSlice; ++curSet) {
+			detectSet(curSet, detector);
+			printSetProgress(curSet);
+		}
+	}
 
-		bool moreWork = true;
-		bool moreLines = setLines.size() < linesPerSet;
-		bool doubleRuns = false;
+	if(unanchoredSets > 0 || ambiguousSets > 0) {
+		VERBOSE("[PROPAGATE] Sets not recorded: " << dec << (unanchoredSets + ambiguousSets)
+				<< " (no known blocks: " << unanchoredSets << ", ambiguous: " << ambiguousSets << ")" << endl)
+		else if(printAllocationInformation) {
+			std::cout << "Sets not recorded: " << dec << (unanchoredSets + ambiguousSets) << endl;
+		}
+	}
 
-		unsigned int allocationRetries = 0;
-		unsigned int maxRetries = 10;
+	rePartitionSets();
 
-		while(moreWork) {
-			if(moreLines) {
-				VERBOSE("[ALLOCATION] Set: " << curSet << " ")
-				else if(printAllocationInformation) {std::cout << "Allocating, " << std::flush;}
+	if(simulator != NULL) {
+		validateSlices("SIMULATION", "Correct slices", [this](unsigned long physcialAddr) {
+			return simulator->getSlice(physcialAddr);
+		});
+	}
 
-				allocateSet(curSet, setLines.size() + linesPerSet);
-				allocationRetries += 1;
-				moreLines = false;
-				VERBOSE("[SUCCESS] Total: " << setLines.size() << " lines ("<< ((double)CacheLine::getTotalAllocatedPoll() / (double)(1<<30)) << " GB)" << endl);
-			}
-			if(doubleRuns) {
-				VERBOSE("[DOUBLE RUNS]" << endl)
-				else if(printAllocationInformation) {std::cout << "Double-runs, " << std::flush;}
-				detector.doubleRuns();
-				doubleRuns = false;
-			}
+	if(trace != NULL && trace->isRecording()) {
+		trace->finish(cacheInfo, availableWays, blockShift, [this](unsigned long physcialAddr) {
+			auto block = blockSlices.find(physcialAddr >> blockShift);
+			return block != blockSlices.end() ? block->second : sliceHash.getSlice(physcialAddr);
+		});
+	} else if(trace != NULL) {
+		// The reference of the replay is the recorded run's slices, not the
+		// true ones, so it only tells whether the replay agrees with the run
+		trace->print(sets);
+		validateSlices("REPLAY", "Consistent slices", [this](unsigned long physcialAddr) {
+			return trace->getSlice(physcialAddr);
+		});
+	}
+}
 
-			try {
-				detector.detectAllCacheSlices(setLines);
-				moreWork = false;
-			} catch (NeedMoreLinesException& e) {
-				VERBOSE("[ERROR] Set: " << dec <<curSet << " - " << e.what() << " => ")
-				else if(printAllocationInformation) {std::cout << e.what() << ", " << endl;}
-				moreWork = true;
-				moreLines = true;
-
-				if(allocationRetries >= maxRetries) {
-					bool error = false;
-					for(auto l = setLines.begin(); l != setLines.end(); ++l) {
-						bool addressCorrect = (*l)->getPhysicalAddr() == (*l)->calculatePhyscialAddr();
-						if(!addressCorrect) {
-							error = true;
-							VERBOSE("   [CHANGED] 0x" << hex << (*l)->getPhysicalAddr() << " != 0x" << (*l)->calculatePhyscialAddr() << std::endl);
-						}
-					}
+void CacheLineAllocator::validateSlices(const char* label, const char* matching,
+		function<int(unsigned long)> trueSlice) {
+	// The detected slices are numbered arbitrarily, and a set that was not
+	// recorded has its own numbers, so in each in-slice set each detected
+	// slice is matched with the true slice of most of its lines
+	unsigned int slices = cacheInfo.cache_slices;
+	vector<vector<unsigned long>> counts(setsPerSlice * slices, vector<unsigned long>(slices, 0));
+	unsigned long total = 0;
+	for(LineTable::id id = 0; id < table->end(); id++) {
+		if(!table->isUsed(id) || table->getCacheSlice(id) < 0) {
+			continue;
+		}
+
+		int slice = trueSlice(table->getPhysicalAddr(id));
+		if(slice < 0 || (unsigned int)slice >= slices) {
+			continue;
+		}
+		counts[table->getSet(id)][slice] += 1;
+		total += 1;
+	}
+
+	unsigned long correct = 0;
+	for(auto c = counts.begin(); c != counts.end(); ++c) {
+		correct += *max_element(c->begin(), c->end());
+	}
+
+	std::cout << "[" << label << "] Lines: " << dec << total << ", " << matching << ": " << correct
+			<< " (" << (total > 0 ? 100. * correct / total : 0.) << "%)" << endl;
+}
+
+void CacheLineAllocator::printSetProgress(unsigned int curSet) {
+	VERBOSE("[SUCCESS SET: " << setfill(' ') << setw(5) << dec << curSet << "] " << endl)
+	else if(printAllocationInformation) {
+		if(curSet % 256 == 255) {
+			std::cout << endl << setfill(' ') << setw(5) << dec << "[SET: " << curSet << "] " << endl << std::flush;
+		} else if(curSet % 8 == 0) {
+			std::cout << "." << std::flush;
+		}
+	}
+}
 
-					if (error){
-						throw LineAllocatorException("Address changed");
+void CacheLineAllocator::detectSet(unsigned int curSet, CacheSliceDetector& detector) {
+	VERBOSE("[SET: " << setfill(' ') << setw(5) << dec << curSet << "] ");
+	detector.restartRuns();
+	auto& setLines = getSet(curSet);
+
+	bool moreWork = true;
+	bool moreLines = setLines.size() < linesPerSet;
+	bool doubleRuns = false;
+
+	unsigned int allocationRetries = 0;
+	unsigned int maxRetries = 10;
+
+	while(moreWork) {
+		if(moreLines) {
+			VERBOSE("[ALLOCATION] Set: " << curSet << " ")
+			else if(printAllocationInformation) {std::cout << "Allocating, " << std::flush;}
+
+			WriteLock lock(setsLock);
+			allocateSet(curSet, setLines.size() + linesPerSet);
+			allocationRetries += 1;
+			moreLines = false;
+			VERBOSE("[SUCCESS] Total: " << setLines.size() << " lines ("<< ((double)getTotalAllocatedPoll() / (double)(1<<30)) << " GB)" << endl);
+		}
+		if(doubleRuns) {
+			VERBOSE("[DOUBLE RUNS]" << endl)
+			else if(printAllocationInformation) {std::cout << "Double-runs, " << std::flush;}
+			detector.doubleRuns();
+			doubleRuns = false;
+		}
+
+		try {
+			{
+				ReadLock lock(setsLock);
+				if(!propagateSlices(setLines, detector)) {
+					detector.detectAllCacheSlices(setLines);
+				}
+			}
+			WriteLock lock(setsLock);
+			recordSlices(setLines);
+			moreWork = false;
+		} catch (NeedMoreLinesException& e) {
+			VERBOSE("[ERROR] Set: " << dec <<curSet << " - " << e.what() << " => ")
+			else if(printAllocationInformation) {std::cout << e.what() << ", " << endl;}
+			moreWork = true;
+			moreLines = true;
+
+			if(allocationRetries >= maxRetries) {
+				WriteLock lock(setsLock);
+				refreshTranslation(setLines);
+
+				bool error = false;
+				for(auto l = setLines.begin(); l != setLines.end(); ++l) {
+					bool addressCorrect = (*l)->getPhysicalAddr() == (*l)->calculatePhyscialAddr();
+					if(!addressCorrect) {
+						error = true;
+						VERBOSE("   [CHANGED] 0x" << hex << (*l)->getPhysicalAddr() << " != 0x" << (*l)->calculatePhyscialAddr() << std::endl);
 					}
+				}
 
-					doubleRuns = true;
-					allocationRetries = 0;
+				if (error){
+					throw LineAllocatorException("Address changed");
 				}
-			} catch (CacheSliceResetException& e) {
-				std::cout.imbue(std::locale());
-				VERBOSE("[ERROR] Set: " << dec << curSet << " - " << e.what()
-							<< " -- for address: 0x" << hex << ((CacheLine::ptr)e.line())->getPhysicalAddr() << " => ")
-				moreWork = true;
-				moreLines = false;
-				doubleRuns = true;
 
-				discardLine((CacheLine*)e.line());
-			} catch (CacheLineException& e) {
-				VERBOSE("[ERROR] Set: " << dec << curSet << " - " << e.what() << " => ")
-				else if(printAllocationInformation) { std::cout << e.what() << ", " << std::flush; }
-				moreWork = true;
-				moreLines = false;
 				doubleRuns = true;
+				allocationRetries = 0;
 			}
+		} catch (CacheSliceResetException& e) {
+			std::cout.imbue(std::locale());
+			VERBOSE("[ERROR] Set: " << dec << curSet << " - " << e.what()
+						<< " -- for address: 0x" << hex << ((CacheLine::ptr)e.line())->getPhysicalAddr() << " => ")
+			moreWork = true;
+			moreLines = false;
+			doubleRuns = true;
+
+			WriteLock lock(setsLock);
+			discardLine((CacheLine*)e.line());
+		} catch (CacheLineException& e) {
+			VERBOSE("[ERROR] Set: " << dec << curSet << " - " << e.what() << " => ")
+			else if(printAllocationInformation) { std::cout << e.what() << ", " << std::flush; }
+			moreWork = true;
+			moreLines = false;
+			doubleRuns = true;
 		}
+	}
+}
 
-		VERBOSE("[SUCCESS SET: " << setfill(' ') << setw(5) << dec << curSet << "] " << endl)
-		else if(printAllocationInformation) {
-			if(curSet % 256 == 255) {
-				std::cout << endl << setfill(' ') << setw(5) << dec << "[SET: " << curSet << "] " << endl << std::flush;
-			} else if(curSet % 8 == 0) {
-				std::cout << "." << std::flush;
+struct DetectionWorker {
+	CacheLineAllocator* allocator;
+	int cpu;
+	const vector<unsigned int>* order;
+	atomic<unsigned int>* next;
+	atomic<bool>* failed;
+	string error;
+};
+
+void* detectionWorkerThread(void* p) {
+	auto worker = reinterpret_cast<DetectionWorker*>(p);
+	try {
+		worker->allocator->runDetectionWorker(worker->cpu, *worker->order, *worker->next, *worker->failed);
+	} catch (exception& e) {
+		worker->error = e.what();
+		*worker->failed = true;
+	}
+
+	return NULL;
+}
+
+vector<int> CacheLineAllocator::getMeasuringCpus() const {
+	// The counter thread of the timer spins on its own core of its socket
+	int timerCpu = getTimerCpu();
+	auto cpus = socket >= 0 ? socketCpus : getSocketCpus(timerCpu >= 0 ? getCpuSocket(timerCpu) : 0);
+	return getOtherCoresCpus(cpus, timerCpu);
+}
+
+void CacheLineAllocator::runDetectionWorker(int cpu, const vector<unsigned int>& order,
+		atomic<unsigned int>& next, atomic<bool>& failed) {
+	if(!pinThreadToCpus(vector<int>(1, cpu))) {
+		throw LineAllocatorException("Failed to pin detection worker");
+	}
+
+	// Each worker calibrates its own tester on its own core
+	CacheSliceDetector workerDetector(verbose);
+	workerDetector.copySettings(detector);
+	workerDetector.init(cacheInfo.cache_slices, availableWays, linesPerSet);
+
+	for(unsigned int i = next++; i < order.size() && !failed; i = next++) {
+		detectSet(order[i], workerDetector);
+		printSetProgress(order[i]);
+	}
+}
+
+void CacheLineAllocator::detectAllSetsInParallel() {
+	auto cpus = getPhysicalCoreCpus(getMeasuringCpus());
+	unsigned int workersCount = min<unsigned int>(detectionWorkers, cpus.size());
+	if(workersCount == 0) {
+		throw LineAllocatorException("No CPUs for the detection workers");
+	}
+
+	// Each worker starts in its own region of the sets, so the sets that are
+	// detected at the same time are far apart.
+	unsigned int region = (setsPerSlice + workersCount - 1) / workersCount;
+	vector<unsigned int> order;
+	for(unsigned int i = 0; i < region; i++) {
+		for(unsigned int w = 0; w < workersCount; w++) {
+			if(w * region + i < setsPerSlice) {
+				order.push_back(w * region + i);
 			}
 		}
 	}
 
-	rePartitionSets();
+	VERBOSE("[PARALLEL] Detection workers: " << dec << workersCount << endl);
+	atomic<unsigned int> next(0);
+	atomic<bool> failed(false);
+	vector<DetectionWorker> workers(workersCount);
+	vector<pthread_t> threads(workersCount);
+	for(unsigned int w = 0; w < workersCount; w++) {
+		workers[w].allocator = this;
+		workers[w].cpu = cpus[w];
+		workers[w].order = &order;
+		workers[w].next = &next;
+		workers[w].failed = &failed;
+		if(pthread_create(&threads[w], NULL, detectionWorkerThread, &workers[w])) {
+			failed = true;
+			workersCount = w;
+			break;
+		}
+	}
+
+	for(unsigned int w = 0; w < workersCount; w++) {
+		pthread_join(threads[w], NULL);
+	}
+
+	for(auto w = workers.begin(); w != workers.end(); ++w) {
+		if(!w->error.empty()) {
+			throw LineAllocatorException(w->error);
+		}
+	}
+	if(failed) {
+		throw LineAllocatorException("Failed creating detection worker");
+	}
+}
+
+bool CacheLineAllocator::propagateSlices(const CacheLine::vec& lines, CacheSliceDetector& detector) {
+	if(blockSlices.empty() && !sliceHash.isLearned()) {
+		return false;
+	}
+
+	// The lines in blocks with a known slice, or with a known hash value,
+	// need no timing. They are also the eviction sets of their slices, for
+	// the rest of the lines.
+	vector<CacheLine::vec> evictionSets(cacheInfo.cache_slices);
+	CacheLine::vec unknown;
+	CacheLine::vec known;
+	CacheLine::vec hashed;
+	for(auto l = lines.begin(); l != lines.end(); ++l) {
+		int slice = getKnownSlice(*l);
+		if(slice < 0) {
+			unknown.push_back(*l);
+			continue;
+		}
+
+		evictionSets[slice].push_back(*l);
+		if(blockSlices.find(getSliceBlock(*l)) != blockSlices.end()) {
+			known.push_back(*l);
+		} else {
+			hashed.push_back(*l);
+		}
+	}
+
+	for(auto e = evictionSets.begin(); e != evictionSets.end(); ++e) {
+		if(e->size() < availableWays) {
+			return false;
+		}
+	}
+
+	detector.reset(lines);
+	// A failed block is left to the detection, which records it again
+	if(!spotCheckSlices(known, evictionSets, detector)) {
+		VERBOSE("[PROPAGATE] Spot-check failed, detecting the set" << endl);
+		return false;
+	}
+	if(!spotCheckSlices(hashed, evictionSets, detector)) {
+		VERBOSE("[HASH] Spot-check failed, learning again" << endl);
+		sliceHash.forget();
+		return false;
+	}
+
+	VERBOSE("[PROPAGATE] Known: " << dec << known.size()
+			<< ", Hashed: " << hashed.size() << ", Classify: " << unknown.size());
+	auto counts = detector.classifyLines(unknown, evictionSets);
+	detector.checkAllDetected(unknown);
+
+	for(auto c = counts.begin(); c != counts.end(); ++c) {
+		if(*c < linesPerSet) {
+			VERBOSE(" [FAILED] Not enough lines for each set" << endl);
+			throw NeedMoreLinesException("Not enough lines for each set");
+		}
+	}
+
+	VERBOSE(" [SUCCESS]" << endl);
+	return true;
+}
+
+bool CacheLineAllocator::spotCheckSlices(const CacheLine::vec& lines, const vector<CacheLine::vec>& evictionSets,
+		CacheSliceDetector& detector) {
+	// A few of the lines must be evicted by the other lines of their slice
+	for(unsigned int i = 0; i < HASH_SPOT_CHECKS && !lines.empty(); i++) {
+		auto line = lines[detector.random() % lines.size()];
+		int slice = getKnownSlice(line);
+
+		CacheLine::vec group;
+		auto& sliceLines = evictionSets[slice];
+		for(auto l = sliceLines.begin(); l != sliceLines.end() && group.size() < availableWays; ++l) {
+			if(*l != line) {
+				group.push_back(*l);
+			}
+		}
+
+		if(group.size() == availableWays && !detector.isEvictedBy(line, group)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void CacheLineAllocator::learnSliceHash(const CacheLine::vec& lines) {
+	if(sliceHash.isLearned() || sliceHash.getSamplesCount() >= HASH_MAX_SAMPLES) {
+		return;
+	}
+
+	unsigned long added = 0;
+	for(auto l = lines.begin(); l != lines.end(); ++l) {
+		if((*l)->getCacheSlice() < 0) {
+			continue;
+		}
+		sliceHash.add((*l)->getPhysicalAddr(), (*l)->getCacheSlice());
+		added += 1;
+	}
+
+	// The hash is checked on the set that was recorded last
+	recordedSets += 1;
+	if(recordedSets % HASH_LEARN_SETS == 0 && sliceHash.learn(added)) {
+		VERBOSE("[HASH] Learned from " << dec << recordedSets << " sets" << endl);
+		if(verbose) {
+			sliceHash.print();
+		}
+	}
+}
+
+void CacheLineAllocator::recordSlices(const CacheLine::vec& lines) {
+	// A set detected from scratch numbers its slices in an arbitrary order.
+	// Each of its slices is renamed to the known slice of most of its lines,
+	// by their blocks or by the slice hash.
+	unsigned int slices = cacheInfo.cache_slices;
+	vector<vector<unsigned int>> votes(slices, vector<unsigned int>(slices, 0));
+	bool anyVotes = false;
+	for(auto l = lines.begin(); l != lines.end(); ++l) {
+		if((*l)->getCacheSlice() < 0) {
+			continue;
+		}
+
+		int known = getKnownSlice(*l);
+		if(known >= 0) {
+			votes[(*l)->getCacheSlice()][known] += 1;
+			anyVotes = true;
+		}
+	}
+
+	// Only the first set names the slices. Other sets can not be compared
+	// with it by timing, so a set with no known lines keeps its own names.
+	if(!anyVotes && (!blockSlices.empty() || sliceHash.isLearned())) {
+		unanchoredSets += 1;
+		VERBOSE("[PROPAGATE] No lines in known blocks, the slices are not recorded" << endl);
+		return;
+	}
+
+	vector<int> rename(slices);
+	for(unsigned int slice = 0; slice < slices; slice++) {
+		rename[slice] = slice;
+		if(anyVotes) {
+			auto best = max_element(votes[slice].begin(), votes[slice].end());
+			rename[slice] = *best > 0 ? best - votes[slice].begin() : -1;
+		}
+	}
+
+	// Only a single slice with no votes can be named by elimination
+	vector<bool> used(slices, false);
+	int unnamed = -1;
+	bool ambiguous = false;
+	for(unsigned int slice = 0; slice < slices && !ambiguous; slice++) {
+		if(rename[slice] < 0) {
+			ambiguous = unnamed >= 0;
+			unnamed = slice;
+		} else if(used[rename[slice]]) {
+			ambiguous = true;
+		} else {
+			used[rename[slice]] = true;
+		}
+	}
+	if(ambiguous) {
+		ambiguousSets += 1;
+		VERBOSE("[PROPAGATE] The slices can not be renamed to the known slices, they are not recorded" << endl);
+		return;
+	}
+	if(unnamed >= 0) {
+		rename[unnamed] = find(used.begin(), used.end(), false) - used.begin();
+	}
+
+	unsigned long conflicts = 0;
+	unsigned long recorded = 0;
+	for(auto l = lines.begin(); l != lines.end(); ++l) {
+		// Lines may be added to the set after it was detected
+		if((*l)->getCacheSlice() < 0) {
+			continue;
+		}
+
+		int slice = rename[(*l)->getCacheSlice()];
+		if(slice != (*l)->getCacheSlice()) {
+			(*l)->resetCacheSlice();
+			(*l)->setCacheSlice(slice);
+		}
+
+		auto block = blockSlices.insert(make_pair(getSliceBlock(*l), slice));
+		if(block.first->second != slice) {
+			conflicts += 1;
+		}
+		recorded += 1;
+	}
+
+	if(!lines.empty()) {
+		recordedInSliceSets[lines[0]->getInSliceSet()] = true;
+	}
+
+	if(conflicts > 0) {
+		VERBOSE("[PROPAGATE] Lines in a block of another slice: " << dec << conflicts << endl);
+	}
+	if(conflicts > BLOCK_CONFLICTS_RATE * recorded) {
+		shrinkBlocks();
+	}
+
+	learnSliceHash(lines);
+}
+
+void CacheLineAllocator::shrinkBlocks() {
+	// The slices of the recorded sets are consistent, so the blocks are
+	// recorded again from their lines
+	if(blockShift > PAGE_SHIFT) {
+		blockShift -= 1;
+	}
+	VERBOSE("[PROPAGATE] Blocks span several slices, block size: " << dec << (1UL << blockShift) << endl);
+
+	// The hash of the larger blocks ignored the bits that split them
+	sliceHash.reset(blockShift);
+	blockSlices.clear();
+	for(LineTable::id id = 0; id < table->end(); id++) {
+		if(table->isUsed(id) && table->getCacheSlice(id) >= 0 && recordedInSliceSets[table->getInSliceSet(id)]) {
+			blockSlices.insert(make_pair(table->getPhysicalAddr(id) >> blockShift, table->getCacheSlice(id)));
+			if(sliceHash.getSamplesCount() < HASH_MAX_SAMPLES) {
+				sliceHash.add(table->getPhysicalAddr(id), table->getCacheSlice(id));
+			}
+		}
+	}
+
+	// The lines are not in the order of their sets, so about a set's worth
+	// of them is held out
+	if(sliceHash.learn(sliceHash.getSamplesCount() / HASH_LEARN_SETS)) {
+		VERBOSE("[HASH] Learned again from the recorded sets" << endl);
+		if(verbose) {
+			sliceHash.print();
+		}
+	}
 }
 
 CacheLine::lst CacheLineAllocator::getSet(int set, unsigned int count) {
-	auto curSet = getSet(set);
+	auto& curSet = getSet(set);
 	CacheLine::lst ret;
 
 	for (auto l = curSet.begin(); l != curSet.end() && ret.size() < count; l++) {
@@ -143,26 +567,107 @@ CacheLine::lst CacheLineAllocator::getSets(unsigned int beginSet, unsigned int e
 	return ret;
 }
 
-const CacheLine::uset& CacheLineAllocator::allocateSet(unsigned long set, unsigned long count) {
+const CacheLine::vec& CacheLineAllocator::allocateSet(unsigned long set, unsigned long count) {
+	unsigned long pageSize = poll->getPageSize();
+	unsigned long inSliceSetsSize = (unsigned long)lineSize * setsPerSlice;
+
+	if(pageSize >= inSliceSetsSize) {
+		// The in-slice set bits are inside the page offset, so each page has
+		// exactly the same number of lines for each in-slice set.
+		unsigned long linesPerPage = pageSize / inSliceSetsSize;
+		unsigned long curCount = linesSets[set].size();
+		if(curCount < count) {
+			unsigned long pages = (count - curCount + linesPerPage - 1) / linesPerPage;
+			for(unsigned long i = 0; i < pages; i++) {
+				allocatePage();
+			}
+		}
+	} else {
+		allocateColoredPages(set, count);
+	}
+
+	return fillSets(set, count);
+}
+
+const CacheLine::vec& CacheLineAllocator::fillSets(unsigned long set, unsigned long count) {
+	// Fills all the sets uniformly until the requested set has enough lines
 	while(linesSets[set].size() < count) {
-		allocateLine();
+		allocatePage();
 	}
 
-	CacheLine::GC();
+	poll->GC();
 
 	return getSet(set);
 }
 
+void CacheLineAllocator::allocateColoredPages(unsigned long set, unsigned long count) {
+	// Like the poll's page offset, only the line in the set's offset in the
+	// page can be in the set. It is built only if the page frame bits of its
+	// physical address match the set as well.
+	unsigned long offset = (set % (PAGE_SIZE / lineSize)) * lineSize;
+	vector<void*> rejectedPages;
+
+	while(linesSets[set].size() < count) {
+		auto page = reinterpret_cast<char*>(poll->newPage(numaNode));
+
+		unsigned long physcialAddr = poll->translatePage(page) + offset;
+		if(trace != NULL && trace->isRecording()) {
+			trace->recordFrame(page, physcialAddr);
+		}
+		if((physcialAddr / lineSize) % setsPerSlice == set) {
+			int node = poll->getPageNode(page);
+			putLine(newLine(page + offset, physcialAddr, node));
+		} else {
+			// Rejected pages are held until the end, so the kernel will not hand
+			// out the same page frames again for this set.
+			rejectedPages.push_back(page);
+		}
+	}
+
+	for(auto page = rejectedPages.begin(); page != rejectedPages.end(); ++page) {
+		poll->releasePage(*page);
+	}
+}
+
+void CacheLineAllocator::allocatePage() {
+	auto page = reinterpret_cast<char*>(poll->newPage(numaNode));
+
+	unsigned long pageSize = poll->getPageSize();
+	int node = poll->getPageNode(page);
+
+	// All the lines in the page share the same page frame, so the page is
+	// translated only once. A huge page is translated once if it is
+	// physically contiguous, otherwise each base page is taken from the
+	// same pagemap read.
+	unsigned long pagePhyscialAddr = poll->translatePage(page);
+	bool contiguous = poll->isPhysicallyContiguous(page);
+
+	unsigned long framePhyscialAddr = pagePhyscialAddr;
+	for (unsigned long offset = 0; offset < pageSize; offset += lineSize) {
+		if (offset % PAGE_SIZE == 0 && offset > 0) {
+			framePhyscialAddr = contiguous ? pagePhyscialAddr + offset : poll->calculatePhyscialAddr(page + offset);
+		}
+
+		unsigned long physcialAddr = framePhyscialAddr + offset % PAGE_SIZE;
+		if(offset % PAGE_SIZE == 0 && trace != NULL && trace->isRecording()) {
+			trace->recordFrame(page + offset, physcialAddr);
+		}
+		putLine(newLine(page + offset, physcialAddr, node));
+	}
+}
+
 void CacheLineAllocator::rePartitionSets() {
-	auto oldMap = linesSets;
+	// A sequential scan of the table, instead of a copy of all the sets
 	linesSets.clear();
-	for(auto setIt=oldMap.begin(); setIt != oldMap.end(); setIt++) {
-		for(auto lineIt=setIt->second.begin(); lineIt != setIt->second.end(); lineIt++) {
-			if((*lineIt)->getCacheSlice() < 0) {
-				discardLine(*lineIt);
-			} else {
-				putLine(*lineIt);
-			}
+	for(LineTable::id id = 0; id < table->end(); id++) {
+		if(!table->isUsed(id)) {
+			continue;
+		}
+
+		if(table->getCacheSlice(id) < 0) {
+			deleteLine(table->line(id));
+		} else {
+			linesSets.insert(table->getSet(id), table->line(id));
 		}
 	}
 }
@@ -171,12 +676,12 @@ void CacheLineAllocator::clean(unsigned int maxElementsInGroup) {
 	if(verbose) {
 		std::cout << endl << "Cleaning..." << endl;
 	}
-	for (auto setIt = linesSets.begin(); setIt != linesSets.end(); setIt++) {
-		while (setIt->second.size() > maxElementsInGroup) {
-			auto lineIt = setIt->second.begin();
-			CacheLine::ptr line = *lineIt;
-			setIt->second.erase(lineIt);
-			delete line;
+	for (unsigned long set = 0; set < linesSets.size(); set++) {
+		auto& lines = linesSets[set];
+		while (lines.size() > maxElementsInGroup) {
+			CacheLine::ptr line = lines.back();
+			lines.pop_back();
+			deleteLine(line);
 		}
 	}
 }
@@ -193,14 +698,12 @@ void CacheLineAllocator::write(const char* path) {
 	outputfile.open(filename);
 	outputfile << "#SET;SLICE;ADDR" << endl;
 
-	for(auto s = linesSets.begin(); s != linesSets.end(); s++) {
-		auto& curSliceSet = s->second;
-
-		for (auto i = curSliceSet.begin(); i != curSliceSet.end(); ++i) {
+	for(LineTable::id id = 0; id < table->end(); id++) {
+		if(table->isUsed(id)) {
 			outputfile << std::hex
-					<< (*i)->getSet() << ";"
-					<< (*i)->getCacheSlice() << ";"
-					<< (*i)->getPhysicalAddr() << std::endl;
+					<< table->getSet(id) << ";"
+					<< table->getCacheSlice(id) << ";"
+					<< table->getPhysicalAddr(id) << std::endl;
 		}
 	}
 
@@ -214,11 +717,178 @@ void CacheLineAllocator::write(const char* path) {
 	strcpy(lastFilename, filename);
 }
 
+static bool readMapRecord(istream& mapFile, vector<unsigned long>& record) {
+	string s;
+	do {
+		if (!getline(mapFile, s)) {
+			return false;
+		}
+	} while (s.empty() || s[0] == '#');
+
+	record.clear();
+	istringstream ss(s);
+	string field;
+	while (getline(ss, field, ';')) {
+		record.push_back(CacheLine::stringToAddr(field));
+	}
+
+	return true;
+}
+
+void CacheLineAllocator::save() {
+	if(!poll->isPersistent()) {
+		return;
+	}
+
+	CacheLine::vec lines;
+	for(LineTable::id id = 0; id < table->end(); id++) {
+		if(table->isUsed(id) && table->getCacheSlice(id) >= 0) {
+			lines.push_back(table->line(id));
+		}
+	}
+	std::sort(lines.begin(), lines.end());
+
+	ofstream mapFile;
+	mapFile.open(getMapFilename().c_str());
+	mapFile << "#LINE-SIZE;SETS-PER-SLICE;SLICES;USED" << endl;
+	mapFile << std::hex << lineSize << ";" << setsPerSlice << ";"
+			<< cacheInfo.cache_slices << ";" << poll->getUsedSize() << endl;
+	mapFile << "#OFFSET;SLICE;ADDR" << endl;
+
+	for (auto i = lines.begin(); i != lines.end(); ++i) {
+		mapFile << std::hex
+				<< poll->offsetOf(*i) << ";"
+				<< (*i)->getCacheSlice() << ";"
+				<< (*i)->getPhysicalAddr() << std::endl;
+	}
+
+	mapFile.close();
+	std::cout << "[SAVE] Saved sets map to " << getMapFilename() << endl;
+}
+
+bool CacheLineAllocator::restore() {
+	if(!poll->isPersistent()) {
+		return false;
+	}
+
+	ifstream mapFile(getMapFilename().c_str());
+	vector<unsigned long> record;
+	if(!mapFile || !readMapRecord(mapFile, record) || record.size() < 4) {
+		return false;
+	}
+
+	if(record[0] != lineSize || record[1] != setsPerSlice || record[2] != cacheInfo.cache_slices) {
+		std::cout << "[RESTORE] Cache geometry changed" << endl;
+		return false;
+	}
+
+	vector<vector<unsigned long>> records;
+	vector<unsigned long> pageNumbers;
+	auto usedSize = record[3];
+	while(readMapRecord(mapFile, record)) {
+		if(record.size() < 3 || record[0] + lineSize > usedSize) {
+			std::cout << "[RESTORE] Corrupted sets map" << endl;
+			return false;
+		}
+		records.push_back(record);
+		pageNumbers.push_back(PTR_TO_ADDR(poll->at(record[0])) >> PAGE_SHIFT);
+	}
+
+	poll->restore(usedSize);
+
+	// Verify that none of the pages moved, in bulk
+	poll->refreshTranslation(pageNumbers);
+	for(auto r = records.begin(); r != records.end(); ++r) {
+		if(poll->calculatePhyscialAddr(poll->at((*r)[0])) != (*r)[2]) {
+			std::cout << "[RESTORE] Physical addresses changed" << endl;
+			poll->GC();
+			return false;
+		}
+	}
+
+	void* lastPage = NULL;
+	int node = -1;
+	for(auto r = records.begin(); r != records.end(); ++r) {
+		auto place = reinterpret_cast<char*>(poll->at((*r)[0]));
+		void* page = PAGE_FRAME_MASK(place);
+		if(page != lastPage) {
+			node = poll->getPageNode(page);
+			lastPage = page;
+		}
+
+		auto line = newLine(place, (*r)[2], node);
+		line->setCacheSlice((*r)[1]);
+		putLine(line);
+	}
+
+	poll->GC();
+
+	for(unsigned int set = 0; set < sets; set++) {
+		if(linesSets[set].size() < linesPerSet) {
+			std::cout << "[RESTORE] Not enough lines in set " << dec << set << endl;
+			clean(0);
+			return false;
+		}
+	}
+
+	std::cout << "[RESTORE] Restored " << dec << records.size() << " lines from " << getMapFilename() << endl;
+	return true;
+}
+
+void CacheLineAllocator::publish(const char* indexFile) {
+	if(!poll->isShared()) {
+		throw LineAllocatorException("Only a shared poll can be published");
+	}
+
+	PlumberIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = PLUMBER_INDEX_MAGIC;
+	header.version = PLUMBER_INDEX_VERSION;
+	header.lineSize = lineSize;
+	header.sets = sets;
+	header.setsPerSlice = setsPerSlice;
+	header.slices = cacheInfo.cache_slices;
+	header.pollSize = poll->getPollSize();
+	strncpy(header.pollPath, poll->getBackingFile().c_str(), sizeof(header.pollPath) - 1);
+
+	vector<PlumberIndexEntry> entries;
+	for(unsigned long set = 0; set < linesSets.size(); set++) {
+		auto& lines = linesSets[set];
+		for (auto i = lines.begin(); i != lines.end(); ++i) {
+			if((*i)->getCacheSlice() < 0) {
+				continue;
+			}
+
+			PlumberIndexEntry entry;
+			entry.set = (*i)->getSet();
+			entry.slice = (*i)->getCacheSlice();
+			entry.offset = poll->offsetOf(*i);
+			entries.push_back(entry);
+		}
+	}
+	header.linesCount = entries.size();
+
+	// Readers never see a partially written index
+	string tmpFile = string(indexFile) + ".tmp";
+	ofstream outputfile(tmpFile.c_str(), ios::binary);
+	outputfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	outputfile.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(PlumberIndexEntry));
+	outputfile.close();
+
+	if(!outputfile || rename(tmpFile.c_str(), indexFile) != 0) {
+		throw LineAllocatorException("Failed to publish index");
+	}
+
+	publishedIndex = indexFile;
+	std::cout << "[SHARE] Published " << dec << entries.size() << " lines of "
+			<< poll->getBackingFile() << " to " << indexFile << endl;
+}
+
 void CacheLineAllocator::print() const {
-	for (auto setIt = linesSets.begin(); setIt != linesSets.end(); setIt++) {
-		cout << "Group: " << dec << setIt->first << endl;
-		for (auto it = setIt->second.begin(); it != setIt->second.end();
-				it++) {
+	for (unsigned long set = 0; set < linesSets.size(); set++) {
+		auto& lines = linesSets[set];
+		cout << "Group: " << dec << set << endl;
+		for (auto it = lines.begin(); it != lines.end(); it++) {
 			(*it)->print();
 		}
 		cout << endl;
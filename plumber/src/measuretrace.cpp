@@ -0,0 +1,336 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "measuretrace.hpp"
+#include "slicehash.hpp"
+
+#define TRACE_MAGIC "PLMTRACE"
+#define TRACE_VERSION 2
+
+/*
+ * The trace is a header followed by records. The header is written again
+ * when the trace is finished, so an unfinished trace is not replayed.
+ */
+struct TraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t lineSize;
+	uint32_t setsPerSlice;
+	uint32_t slices;
+	uint32_t ways;
+	uint32_t availableWays;	// 0: not finished
+	uint32_t seed;
+	uint32_t blockShift;	// The slices are recorded by blocks of 1 << blockShift bytes
+};
+
+enum TraceRecordType {
+	FRAME_RECORD = 'F',			// uint64 frame number, of the page index in the poll (the lines count)
+	MEASUREMENT_RECORD = 'M',	// uint32 line index[lines], uint16 sample[samples], int32 result
+	SLICE_RECORD = 'S',			// uint64 block, int32 slice
+};
+
+struct TraceRecord {
+	uint8_t type;
+	uint8_t kind;
+	uint16_t reserved;
+	uint32_t linesCount;
+	uint32_t samplesCount;
+};
+
+MeasureTrace::MeasureTrace(const char* path, Mode mode) : mode(mode), path(path), poll(NULL),
+		lineSize(0), setsPerSlice(0), slices(0), ways(0), availableWays(0), seed(1), blockShift(SLICE_BLOCK_SHIFT),
+		measurementsCount(0), sameSetTests(0), replayedSamples(0), modeledSamples(0),
+		matchingDecisions(0), replayedDecisions(0) {
+	pthread_mutex_init(&mutex, NULL);
+
+	if(mode == REPLAY) {
+		load();
+		return;
+	}
+
+	file.open(path, ios::binary | ios::trunc);
+	TraceHeader header;
+	memset(&header, 0, sizeof(header));
+	write(header);
+	if(!file) {
+		throw MeasureTraceException("Failed to open trace for recording: " + this->path);
+	}
+}
+
+MeasureTrace::~MeasureTrace() {
+	if(file.is_open()) {
+		file.close();
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+void MeasureTrace::attach(ObjectPoll* poll, unsigned int lineSize) {
+	if(mode == REPLAY && lineSize != this->lineSize) {
+		throw MeasureTraceException("The trace was recorded with another line size");
+	}
+	this->poll = poll;
+	this->lineSize = lineSize;
+}
+
+void MeasureTrace::recordFrame(const void* page, unsigned long physcialAddr) {
+	TraceRecord record = {FRAME_RECORD, 0, 0, (uint32_t)(poll->offsetOf(page) >> PAGE_SHIFT), 0};
+
+	pthread_mutex_lock(&mutex);
+	write(record);
+	write((uint64_t)(physcialAddr >> PAGE_SHIFT));
+	recordedFrames.insert(physcialAddr >> PAGE_SHIFT);
+	pthread_mutex_unlock(&mutex);
+}
+
+void MeasureTrace::recordMeasurement(int kind, CacheLine::arr lines, unsigned int count,
+		const int* times, unsigned long timesCount, int result) {
+	TraceRecord record = {MEASUREMENT_RECORD, (uint8_t)kind, 0, count, (uint32_t)timesCount};
+
+	pthread_mutex_lock(&mutex);
+	write(record);
+	for(unsigned int i = 0; i < count; i++) {
+		write((uint32_t)lineIndex(lines[i]));
+	}
+	// Slower samples than this are outliers anyway
+	for(unsigned long i = 0; i < timesCount; i++) {
+		write((uint16_t)std::min(std::max(times[i], 0), 0xffff));
+	}
+	write((int32_t)result);
+	pthread_mutex_unlock(&mutex);
+
+	measurementsCount += 1;
+	if(kind == SAME_SET) {
+		sameSetTests += 1;
+	}
+}
+
+void MeasureTrace::finish(const CacheInfo& info, unsigned int availableWays, unsigned int blockShift,
+		function<int(unsigned long physcialAddr)> slice) {
+	TraceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.lineSize = info.coherency_line_size;
+	header.setsPerSlice = info.sets / info.cache_slices;
+	header.slices = info.cache_slices;
+	header.ways = info.ways_of_associativity;
+	header.availableWays = availableWays;
+	header.seed = seed;
+	header.blockShift = blockShift;
+
+	pthread_mutex_lock(&mutex);
+	// The blocks are known once the run is done, as they may shrink
+	unordered_set<unsigned long> recordedBlocks;
+	for(auto f = recordedFrames.begin(); f != recordedFrames.end(); ++f) {
+		recordedBlocks.insert((*f << PAGE_SHIFT) >> blockShift);
+	}
+
+	unsigned long knownBlocks = 0;
+	for(auto b = recordedBlocks.begin(); b != recordedBlocks.end(); ++b) {
+		int blockSlice = slice(*b << blockShift);
+		if(blockSlice < 0) {
+			continue;
+		}
+
+		TraceRecord record = {SLICE_RECORD, 0, 0, 0, 0};
+		write(record);
+		write((uint64_t)*b);
+		write((int32_t)blockSlice);
+		knownBlocks += 1;
+	}
+
+	file.seekp(0);
+	write(header);
+	file.flush();
+	bool failed = !file;
+	pthread_mutex_unlock(&mutex);
+
+	if(failed) {
+		throw MeasureTraceException("Failed to write trace: " + path);
+	}
+
+	std::cout << "[TRACE] Recorded " << dec << measurementsCount << " measurements ("
+			<< sameSetTests << " same-set tests), " << recordedFrames.size() << " frames and "
+			<< knownBlocks << "/" << recordedBlocks.size() << " blocks' slices to " << path << endl;
+}
+
+void MeasureTrace::load() {
+	ifstream input(path.c_str(), ios::binary);
+	TraceHeader header;
+	if(!input.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+		throw MeasureTraceException("Failed to read trace: " + path);
+	}
+	if(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION) {
+		throw MeasureTraceException("Not a trace, or of another version: " + path);
+	}
+	if(header.availableWays == 0) {
+		throw MeasureTraceException("The trace was not finished: " + path);
+	}
+
+	lineSize = header.lineSize;
+	setsPerSlice = header.setsPerSlice;
+	slices = header.slices;
+	ways = header.ways;
+	availableWays = header.availableWays;
+	seed = header.seed;
+	blockShift = header.blockShift;
+	if(blockShift < PAGE_SHIFT || blockShift >= SLICE_HASH_MAX_BIT) {
+		throw MeasureTraceException("Corrupted trace: " + path);
+	}
+
+	vector<uint32_t> indexes;
+	TraceRecord record;
+	while(input.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+		if(record.type == FRAME_RECORD) {
+			uint64_t frame;
+			input.read(reinterpret_cast<char*>(&frame), sizeof(frame));
+			frames[record.linesCount] = (unsigned long)frame << PAGE_SHIFT;
+		} else if(record.type == SLICE_RECORD) {
+			uint64_t block;
+			int32_t slice;
+			input.read(reinterpret_cast<char*>(&block), sizeof(block));
+			input.read(reinterpret_cast<char*>(&slice), sizeof(slice));
+			blockSlices[block] = slice;
+		} else if(record.type == MEASUREMENT_RECORD) {
+			indexes.resize(record.linesCount);
+			input.read(reinterpret_cast<char*>(indexes.data()), indexes.size() * sizeof(uint32_t));
+
+			Stored stored = {samples.size(), record.samplesCount, 0};
+			samples.resize(samples.size() + record.samplesCount);
+			input.read(reinterpret_cast<char*>(samples.data() + stored.firstSample), record.samplesCount * sizeof(uint16_t));
+			int32_t result;
+			input.read(reinterpret_cast<char*>(&result), sizeof(result));
+			stored.result = result;
+
+			// The calibration samples are the pools of the modeled samples
+			auto first = samples.begin() + stored.firstSample;
+			if(record.kind == SAMPLE_HIT) {
+				hitSamples.insert(hitSamples.end(), first, first + record.samplesCount);
+			} else if(record.kind == SAMPLE_MISS || record.kind == TIME_MISS) {
+				missSamples.insert(missSamples.end(), first, first + record.samplesCount);
+			}
+
+			unsigned long h = 14695981039346656037UL ^ record.kind;
+			for(auto i = indexes.begin(); i != indexes.end(); ++i) {
+				h = (h ^ *i) * 1099511628211UL;
+			}
+			measurements[h].recordings.push_back(stored);
+		} else {
+			throw MeasureTraceException("Corrupted trace: " + path);
+		}
+	}
+
+	if(!input.eof()) {
+		throw MeasureTraceException("Failed to read trace: " + path);
+	}
+	if(hitSamples.empty() || missSamples.empty()) {
+		throw MeasureTraceException("The trace has no calibration samples: " + path);
+	}
+}
+
+CacheInfo MeasureTrace::getCacheInfo() const {
+	CacheInfo info;
+	info.level = 3;
+	info.setCacheType(3);
+	info.coherency_line_size = lineSize;
+	info.physical_line_partitions = 1;
+	info.ways_of_associativity = ways;
+	info.cache_slices = slices;
+	info.sets = setsPerSlice * slices;
+	info.total_size = (size_t)info.sets * ways * lineSize;
+	info.is_fully_associative = false;
+	info.is_self_initializing = true;
+	return info;
+}
+
+unsigned long MeasureTrace::translate(const void* ptr) {
+	unsigned long offset = poll->offsetOf(ptr);
+	auto frame = frames.find(offset >> PAGE_SHIFT);
+	if(frame == frames.end()) {
+		throw MeasureTraceException("The replay allocated a page that was not recorded");
+	}
+
+	return frame->second | (offset & (PAGE_SIZE - 1));
+}
+
+unsigned long MeasureTrace::key(int kind, CacheLine::arr lines, unsigned int count) const {
+	// FNV-1a of the kind and the lines, as the trace is indexed on load
+	unsigned long h = 14695981039346656037UL ^ kind;
+	for(unsigned int i = 0; i < count; i++) {
+		h = (h ^ (uint32_t)lineIndex(lines[i])) * 1099511628211UL;
+	}
+	return h;
+}
+
+bool MeasureTrace::replay(int kind, CacheLine::arr lines, unsigned int count, Recording& recording) {
+	if(kind == SAME_SET) {
+		sameSetTests += 1;
+	}
+	measurementsCount += 1;
+
+	auto h = key(kind, lines, count);
+	bool found = false;
+
+	pthread_mutex_lock(&mutex);
+	auto queue = measurements.find(h);
+	if(queue != measurements.end() && queue->second.next < queue->second.recordings.size()) {
+		auto& stored = queue->second.recordings[queue->second.next++];
+		recording.samples = samples.data() + stored.firstSample;
+		recording.samplesCount = stored.samplesCount;
+		recording.result = stored.result;
+		found = true;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return found;
+}
+
+int MeasureTrace::getSlice(unsigned long physcialAddr) const {
+	auto slice = blockSlices.find(physcialAddr >> blockShift);
+	return slice != blockSlices.end() ? slice->second : -1;
+}
+
+long MeasureTrace::getSet(unsigned long physcialAddr) const {
+	int slice = getSlice(physcialAddr);
+	if(slice < 0) {
+		return -1;
+	}
+	return (physcialAddr / lineSize) % setsPerSlice + (long)slice * setsPerSlice;
+}
+
+int MeasureTrace::drawSample(bool miss, unsigned int& seed) const {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	auto& pool = miss ? missSamples : hitSamples;
+	return pool[seed % pool.size()];
+}
+
+void MeasureTrace::print(unsigned int sets) const {
+	std::cout << "[REPLAY] Measurements: " << dec << measurementsCount
+			<< ", Same-set tests: " << sameSetTests
+			<< " (" << (sets > 0 ? (double)sameSetTests / sets : 0.) << " per set)"
+			<< ", Replayed samples: " << replayedSamples
+			<< ", Modeled samples: " << modeledSamples
+			<< ", Matching decisions: " << matchingDecisions << "/" << replayedDecisions << endl;
+}
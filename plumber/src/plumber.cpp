@@ -39,6 +39,7 @@
 #include "Messages.h"
 #include "lineallocator.hpp"
 #include "timing.h"
+#include "topology.h"
 #include "TouchWorker.hpp"
 
 #define LLC 3
@@ -104,16 +105,58 @@ bool getBoolArgument(int argc, const char* argv[],
 	return res;
 }
 
+struct AllocationJob {
+	Allocator* allocator;
+	bool fake;
+	string error;
+};
+
+void* allocationThread(void* p) {
+	auto job = reinterpret_cast<AllocationJob*>(p);
+	try {
+		if(!job->fake) {
+			if(!job->allocator->restore()) {
+				job->allocator->allocateAllSets();
+			}
+			job->allocator->save();
+		} else{
+			job->allocator->allocateSet(0, job->allocator->getLinesPerSet());
+		}
+	} catch (exception& e) {
+		job->error = e.what();
+	}
+
+	return NULL;
+}
+
 int main(int argc, const char* argv[]) {
 	// According to actual ways in the CPU
 	auto linesPerSet   = getNumberArgument(argc, argv, 0, "--lines-per-set", "-l");
-	auto availableWays = getNumberArgument(argc, argv, 2, "--ways",          "-w");
+	// 0: probe the ways that are usable under the CAT mask
+	auto availableWays = getNumberArgument(argc, argv, 0, "--ways",          "-w");
 	auto workersCount  = getNumberArgument(argc, argv, 1, "--workers",       "-t");
+	auto pollSizeGB    = getNumberArgument(argc, argv, POLL_SIZE >> 30, "--poll-size-gb");
+	auto testErrorPPM  = getNumberArgument(argc, argv, 1000, "--test-error-ppm");
+	auto detectWorkers = getNumberArgument(argc, argv, 1, "--detection-workers");
 	auto path          = getStringArgument(argc, argv,    "--path",          "-p");
+	auto pollFile      = getStringArgument(argc, argv, "", "--poll-file");
+	auto shareIndex    = getStringArgument(argc, argv, "", "--share");
+	auto timer         = getStringArgument(argc, argv, "auto", "--timer");
+	auto accessPattern = getStringArgument(argc, argv, "auto", "--access-pattern");
+	auto simulate      = getStringArgument(argc, argv, "", "--simulate");
+	auto recordTrace   = getStringArgument(argc, argv, "", "--record");
+	auto replayTrace   = getStringArgument(argc, argv, "", "--replay");
+	// 0: the recorded seed when replaying, otherwise 1
+	auto seed          = getNumberArgument(argc, argv, 0, "--seed");
 	auto deamonize     = getBoolArgument  (argc, argv,    "--daemon",        "-d");
 	auto verbose       = getBoolArgument  (argc, argv,    "--verbose",       "-v");
 	auto doBenchmark   = getBoolArgument  (argc, argv,    "--benchmark");
 	auto fake 		   = getBoolArgument  (argc, argv,    "--fake");
+	auto hugePages     = getBoolArgument  (argc, argv,    "--huge-pages");
+	auto allSockets    = getBoolArgument  (argc, argv,    "--all-sockets");
+	auto linearReduce  = getBoolArgument  (argc, argv,    "--linear-reduction");
+	auto conflictSet   = getBoolArgument  (argc, argv,    "--conflict-set");
+	auto usePmu        = getBoolArgument  (argc, argv,    "--pmu");
 
 	if(deamonize) {
 		daemonize("plumber", NULL, log_file);
@@ -121,15 +164,118 @@ int main(int argc, const char* argv[]) {
 
 	int ret = 0;
 	try {
+		////////////////////////////////////////////////////////////////////////
+		// Timer
+		////////////////////////////////////////////////////////////////////////
+		if(strcmp(timer, "auto") == 0) {
+			calibrateTimers(verbose);
+		} else if(!setTimerBackend(timer)) {
+			throw PlumberException("Unknown or unavailable timer");
+		}
+		std::cout << "Timer: " << getTimerName(g_timerBackend) << endl;
+		// The counter thread is joined on any exit
+		atexit(stopTimers);
+		LatencyHistogram::setBinsCount(getTimerHistogramBins());
+
 		////////////////////////////////////////////////////////////////////////
 		// Allocation
 		////////////////////////////////////////////////////////////////////////
 		auto start = gettime();
-		Allocator a = Allocator(LLC, linesPerSet, availableWays, verbose);
-		if(!fake) {
-			a.allocateAllSets();
-		} else{
-			a.allocateSet(0, a.getLinesPerSet());
+
+		// Each allocator gets its own simulated LLC, which must outlive it
+		vector<unique_ptr<CacheSimulator>> simulators;
+		auto newSimulator = [&]() -> CacheSimulator* {
+			if(simulate[0] == 0) {
+				return NULL;
+			}
+			simulators.emplace_back(new CacheSimulator(CacheSimConfig::parse(simulate)));
+			return simulators.back().get();
+		};
+
+		// Each allocator records to, or replays, its own trace
+		if(recordTrace[0] != 0 && replayTrace[0] != 0) {
+			throw PlumberException("Can not record and replay at once");
+		}
+		vector<unique_ptr<MeasureTrace>> traces;
+		unsigned int socketsCount = allSockets ? getSocketsCount() : 1;
+		for(unsigned int i=0; i < socketsCount; i++) {
+			const char* tracePath = recordTrace[0] != 0 ? recordTrace : replayTrace;
+			if(tracePath[0] == 0) {
+				traces.emplace_back();
+				continue;
+			}
+			string socketTrace = allSockets ? string(tracePath) + "-" + to_string(i) : string(tracePath);
+			traces.emplace_back(new MeasureTrace(socketTrace.c_str(),
+					recordTrace[0] != 0 ? MeasureTrace::RECORD : MeasureTrace::REPLAY));
+		}
+
+		// The testers are seeded in order, so a replay takes the recorded seed
+		unsigned int testersSeed = seed != 0 ? seed : 1;
+		if(seed == 0 && traces[0] && traces[0]->isReplaying()) {
+			testersSeed = traces[0]->getSeed();
+		}
+		SetTester::seedTesters(testersSeed);
+		for(auto t = traces.begin(); t != traces.end(); ++t) {
+			if(*t && (*t)->isRecording()) {
+				(*t)->setSeed(testersSeed);
+			}
+		}
+		std::cout << "Seed: " << testersSeed << endl;
+
+		vector<unique_ptr<Allocator>> allocators;
+		if(allSockets) {
+			// One allocator per socket, each from its socket's local memory
+			for(unsigned int socket=0; socket < getSocketsCount(); socket++) {
+				string socketPollFile = string(pollFile) + "-" + to_string(socket);
+				allocators.emplace_back(new Allocator(LLC, linesPerSet, availableWays, verbose, hugePages, socket, pollSizeGB << 30,
+						pollFile[0] != 0 ? socketPollFile.c_str() : NULL, shareIndex[0] != 0, newSimulator(),
+						traces[socket].get()));
+			}
+		} else {
+			allocators.emplace_back(new Allocator(LLC, linesPerSet, availableWays, verbose, hugePages, -1, pollSizeGB << 30,
+					pollFile[0] != 0 ? pollFile : NULL, shareIndex[0] != 0, newSimulator(), traces[0].get()));
+		}
+
+		SetTester::AccessPattern pattern = SetTester::SINGLE_PASS;
+		bool autoPattern = strcmp(accessPattern, "auto") == 0;
+		if(!autoPattern && !SetTester::parseAccessPattern(accessPattern, pattern)) {
+			throw PlumberException("Unknown access pattern");
+		}
+
+		vector<AllocationJob> jobs(allocators.size());
+		for(unsigned int i=0; i < allocators.size(); i++) {
+			allocators[i]->setTestErrorBound((double)testErrorPPM / 1e6);
+			allocators[i]->setReductionMode(linearReduce ? SetTester::LINEAR_REDUCTION : SetTester::GROUP_REDUCTION);
+			allocators[i]->setDetectionMode(conflictSet ?
+					CacheSliceDetector::CONFLICT_SET_DETECTION : CacheSliceDetector::PER_SLICE_DETECTION);
+			allocators[i]->setDetectionWorkers(detectWorkers);
+			allocators[i]->setPmu(usePmu);
+			if(!autoPattern) {
+				allocators[i]->setAccessPattern(pattern);
+			}
+			jobs[i].allocator = allocators[i].get();
+			jobs[i].fake = fake;
+		}
+
+		if(jobs.size() == 1) {
+			allocationThread(&jobs[0]);
+		} else {
+			vector<pthread_t> threads(jobs.size());
+			for(unsigned int i=0; i < jobs.size(); i++) {
+				int res = pthread_create(&threads[i], NULL, allocationThread, &jobs[i]);
+				if (res) {
+					throw PlumberException("Failed creating allocation thread");
+				}
+			}
+			for(unsigned int i=0; i < jobs.size(); i++) {
+				pthread_join(threads[i], NULL);
+			}
+		}
+
+		for(auto job = jobs.begin(); job != jobs.end(); ++job) {
+			if(!job->error.empty()) {
+				throw PlumberException(job->error);
+			}
 		}
 		auto end = gettime();
 
@@ -138,7 +284,14 @@ int main(int argc, const char* argv[]) {
 		double timeMin = (double)duration.tv_sec/60.;
 		std::cout << std::fixed << std::setprecision(2) << dec;
 		std::cout << endl << "Allocation duration: " << timeMin << " Minutes (" << duration.tv_sec << " sec. and " << duration.tv_nsec << " nsec.)" << endl;
-		a.write(path);
+		for(unsigned int i=0; i < allocators.size(); i++) {
+			allocators[i]->write(path);
+
+			if(shareIndex[0] != 0) {
+				string index = allocators.size() == 1 ? string(shareIndex) : string(shareIndex) + "-" + to_string(i);
+				allocators[i]->publish(index.c_str());
+			}
+		}
 
 		if(doBenchmark) {
 			return 0;
@@ -148,11 +301,17 @@ int main(int argc, const char* argv[]) {
 		// Message Loop
 		////////////////////////////////////////////////////////////////////////
 		Messages msg(queue_fifo);
-		std::unique_ptr<TouchWorker*[]> workers(new TouchWorker*[workersCount]);
+		// Each allocator (socket) has its own workers
+		std::unique_ptr<TouchWorker*[]> workers(new TouchWorker*[workersCount * allocators.size()]);
 
-		for(unsigned int i=0; i < workersCount; i++) {
-			workers[i] = new TouchWorker(a);
-			workers[i]->startTouchThread();
+		for(unsigned int s=0; s < allocators.size(); s++) {
+			// A worker per physical core of the allocator's socket, if it has one
+			auto cpus = getPhysicalCoreCpus(allocators[s]->getCpus());
+			for(unsigned int i=0; i < workersCount; i++) {
+				int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+				workers[s*workersCount + i] = new TouchWorker(*allocators[s], cpu);
+				workers[s*workersCount + i]->startTouchThread();
+			}
 		}
 
 		while(msg.readQueue()) {
@@ -165,6 +324,7 @@ int main(int argc, const char* argv[]) {
 				} else if(op == "t" || op == "touch") {
 					auto t = workers[0]->defaultInfo();
 					unsigned int multiWorkers = 1;
+					unsigned int socket = 0;
 
 					while(msg.haveTokens()) {
 						string touchOp = msg.popStringToken();
@@ -188,6 +348,8 @@ int main(int argc, const char* argv[]) {
 							t.flushAfter = true;
 						}  else if(touchOp == "multi" || touchOp == "m") {
 							multiWorkers = msg.popNumberToken();
+						} else if(touchOp == "socket" || touchOp == "s") {
+							socket = msg.popNumberToken();
 						} else {
 							throw UnknownOperation(op + " " + touchOp);
 						}
@@ -197,6 +359,9 @@ int main(int argc, const char* argv[]) {
 						if(multiWorkers > workersCount) {
 							throw UnknownOperation("Multi workers must be less then workers count");
 						}
+						if(socket >= allocators.size()) {
+							throw UnknownOperation("No allocator for socket");
+						}
 						if( (t.endSet - t.beginSet + 1) % multiWorkers != 0) {
 							throw UnknownOperation("Workers multiplicity must divide the sets count");
 						}
@@ -204,7 +369,7 @@ int main(int argc, const char* argv[]) {
 						t.endSet = t.beginSet + chunk - 1;
 
 						for(unsigned int i=0; i < multiWorkers; i++) {
-							workers[i]->sendJob(t);
+							workers[socket*workersCount + i]->sendJob(t);
 							t.beginSet += chunk;
 							t.endSet += chunk;
 						}
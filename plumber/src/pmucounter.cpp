@@ -0,0 +1,86 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "pmucounter.hpp"
+
+bool PmuCounter::open() {
+	// The LLC read misses, or the generic cache misses if they are not exposed
+	if(open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16))) {
+		return true;
+	}
+
+	return open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+}
+
+bool PmuCounter::open(unsigned int type, unsigned long long config) {
+	close();
+#if !defined(__x86_64__)
+	// Only read with rdpmc
+	(void)type;
+	(void)config;
+	return false;
+#else
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	// Always on the PMU while the thread runs, instead of multiplexed
+	attr.pinned = 1;
+
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if(fd < 0) {
+		return false;
+	}
+
+	void* addr = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) {
+		close();
+		return false;
+	}
+	page = reinterpret_cast<volatile perf_event_mmap_page*>(addr);
+
+	// The counter is only readable in user space while it is scheduled
+	if(!page->cap_user_rdpmc || page->index == 0) {
+		close();
+		return false;
+	}
+
+	mask = page->pmc_width >= 64 ? ~0ULL : (1ULL << page->pmc_width) - 1;
+	return true;
+#endif
+}
+
+void PmuCounter::close() {
+	if(page != NULL) {
+		munmap(const_cast<perf_event_mmap_page*>(page), sysconf(_SC_PAGESIZE));
+		page = NULL;
+	}
+	if(fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
@@ -16,14 +16,36 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
-#include <memory>
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <unordered_map>
 
 #include "timing.h"
 #include "settester.hpp"
 #include "ObjectPoll.h"
+#include "cachesim.hpp"
+#include "measuretrace.hpp"
+
+static std::atomic<unsigned int> testersSeed(1);
+
+void SetTester::seedTesters(unsigned int seed) {
+	testersSeed = seed;
+}
+
+unsigned int SetTester::nextSeed() {
+	// A golden ratio step, mixed as in murmur3's finalizer
+	unsigned int s = testersSeed.fetch_add(0x9e3779b9);
+	s ^= s >> 16;
+	s *= 0x85ebca6b;
+	s ^= s >> 13;
+	s *= 0xc2b2ae35;
+	s ^= s >> 16;
+	return s | 1;
+}
 
 CacheLine::arr SetTester::getRandomArray() {
-	auto i = rand() % TEST_LINES_ARRAYS;
+	auto i = random() % TEST_LINES_ARRAYS;
 	if(testLinesArrays[i] == NULL) {
 		testLinesArrays[i] = new CacheLine::ptr[maxTestLinesCount];
 	}
@@ -34,104 +56,280 @@ void SetTester::clearArrays() {
 	for(unsigned int i=0; i < TEST_LINES_ARRAYS; ++i) {
 		if(testLinesArrays[i] != NULL) {
 			delete[] testLinesArrays[i];
+			testLinesArrays[i] = NULL;
 		}
 	}
 }
 
-#define DUMMY_SIZE ( (1<<12)/sizeof(int) )
-int g_dummy[DUMMY_SIZE];
+/*
+ * A probe loads, flushes and times the lines. The hardware probe accesses the
+ * lines themselves with the interrupts disabled; the simulated probe accesses
+ * the simulated cache while holding it.
+ */
+struct HardwareProbe {
+	int* dummy;
+	const PmuCounter* pmu;
 
-// Measure the time taken to access the given address, in nanoseconds.
-inline int time_access(void* ptr, unsigned int loc)
-		__attribute__((always_inline));
-inline int time_access(void* ptr, unsigned int loc) {
-//	struct timespec ts0;
-//	clock_gettime(CLOCK_MONOTONIC, &ts0-Winline);
+	HardwareProbe(int* dummy, const PmuCounter* pmu) : dummy(dummy), pmu(pmu) {}
 
-	unsigned long long start = rdtsc(), end;
-	g_dummy[loc] += *(volatile int *) ptr;
-	mfence();
-	end = rdtsc();
-	return end - start;
+	inline void load(CacheLine::ptr line) __attribute__((always_inline)) {
+		*dummy += *(volatile int *) line;
+	}
 
-//	struct timespec ts;
-//	clock_gettime(CLOCK_MONOTONIC, &ts);-Winline
-//	return (int)((ts.tv_sec - ts0.tv_sec) * 1000000000 + (ts.tv_nsec - ts0.tv_nsec));
-}
+	inline void flush(CacheLine::ptr line) __attribute__((always_inline)) {
+		line->flushFromCache();
+	}
+
+	inline void fence() __attribute__((always_inline)) {
+		mfence();
+	}
+
+	// Measure the time taken to access the given address, in the timer's units.
+	// With a PMU counter, the number of LLC misses of the access is measured instead.
+	inline int time(CacheLine::ptr line) __attribute__((always_inline)) {
+		if(pmu != NULL) {
+			unsigned long long start = pmu->read();
+			load(line);
+			return pmu->diff(start, pmu->read());
+		}
+
+		unsigned long long start = timerStart();
+		load(line);
+		unsigned long long end = timerEnd();
+		return end - start;
+	}
+
+	inline void begin() __attribute__((always_inline)) {
+		iopl(3);
+		__asm__ __volatile__("cli");
+	}
+
+	inline void end() __attribute__((always_inline)) {
+		__asm__ __volatile__("sti");
+	}
+};
+
+struct SimulatedProbe {
+	CacheSimulator* simulator;
+
+	SimulatedProbe(CacheSimulator* simulator) : simulator(simulator) {}
+
+	void load(CacheLine::ptr line) { simulator->access(line->getPhysicalAddr()); }
+	void flush(CacheLine::ptr line) { simulator->flush(line->getPhysicalAddr()); }
+	void fence() {}
+	int time(CacheLine::ptr line) { return simulator->access(line->getPhysicalAddr()); }
+	void begin() { simulator->lock(); }
+	void end() { simulator->unlock(); }
+};
+
+/*
+ * The replay probe returns the recorded samples of the measurement, if it was
+ * recorded. Otherwise, the samples are drawn from the recorded hits and
+ * misses: a line is missed if it was flushed, or if enough lines of its
+ * recorded set were accessed after it (an LRU set of the available ways).
+ */
+struct ReplayProbe {
+	MeasureTrace* trace;
+	MeasureTrace::Recording recording;
+	bool recorded;
+	unsigned int nextSample;
+	unsigned int ways;
+	unsigned int seed;
+
+	// The cached lines of each recorded set (-1: not known) by their last
+	// access, the most recent first, and the place of each cached line
+	struct Cached {
+		long set;
+		std::list<CacheLine::ptr>::iterator position;
+	};
+	std::unordered_map<long, std::list<CacheLine::ptr>> sets;
+	std::unordered_map<CacheLine::ptr, Cached> cached;
+	unsigned long modeled;
+
+	ReplayProbe(MeasureTrace* trace, int kind, CacheLine::arr lines, unsigned int count, unsigned int seed) :
+			trace(trace), nextSample(0), ways(trace->getAvailableWays()), seed(seed), modeled(0) {
+		recorded = trace->replay(kind, lines, count, recording);
+		cached.reserve(count);
+	}
+
+	~ReplayProbe() {
+		trace->countSamples(nextSample, modeled);
+	}
+
+	// The recorded decision of the measurement, if it was recorded
+	bool getRecordedResult(int& result) const {
+		result = recording.result;
+		return recorded;
+	}
+
+	void load(CacheLine::ptr line) {
+		flush(line);
+		long set = trace->getSet(line->getPhysicalAddr());
+		auto& setLines = sets[set];
+		setLines.push_front(line);
+		Cached c = {set, setLines.begin()};
+		cached[line] = c;
+	}
+
+	void flush(CacheLine::ptr line) {
+		auto c = cached.find(line);
+		if(c != cached.end()) {
+			sets[c->second.set].erase(c->second.position);
+			cached.erase(c);
+		}
+	}
 
-inline void clearLines(CacheLine::arr lines, unsigned long count)
+	void fence() {}
+
+	int time(CacheLine::ptr line) {
+		if(recorded && nextSample < recording.samplesCount) {
+			load(line);
+			return recording.samples[nextSample++];
+		}
+
+		// A cached line of an unknown set is a hit
+		bool miss = true;
+		auto c = cached.find(line);
+		if(c != cached.end()) {
+			unsigned int newer = 0;
+			if(c->second.set >= 0) {
+				auto& setLines = sets[c->second.set];
+				for(auto n = setLines.begin(); n != c->second.position && newer < ways; ++n) {
+					newer += 1;
+				}
+			}
+			miss = newer >= ways;
+		}
+
+		load(line);
+		modeled += 1;
+		return trace->drawSample(miss, seed);
+	}
+
+	void begin() {}
+	void end() {}
+};
+
+template<typename Probe>
+inline void clearLines(CacheLine::arr lines, unsigned long count, Probe& probe)
 		__attribute__((always_inline));
 
-inline void clearLines(CacheLine::arr lines, unsigned long count) {
+template<typename Probe>
+inline void clearLines(CacheLine::arr lines, unsigned long count, Probe& probe) {
 	for (unsigned int i = 0; i < count; i++) {
-		lines[i]->flushFromCache();
+		probe.flush(lines[i]);
 	}
-	mfence();
+	probe.fence();
 }
 
-inline int time_last_access(CacheLine::arr lines, unsigned long size, unsigned int loc)
-		__attribute__((always_inline));
-inline int time_last_access(CacheLine::arr lines, unsigned long size, unsigned int loc) {
-	clearLines(lines, size);
+// Overlapping windows of this many lines, each accessed this many times
+#define PATTERN_WINDOW 3
+#define PATTERN_REPEATS 2
+
+template<typename Probe>
+inline void access_lines(CacheLine::arr lines, unsigned long size, Probe& probe,
+		SetTester::AccessPattern pattern) __attribute__((always_inline));
+template<typename Probe>
+inline void access_lines(CacheLine::arr lines, unsigned long size, Probe& probe,
+		SetTester::AccessPattern pattern) {
+	switch(pattern) {
+	case SetTester::DOUBLE_PASS:
+		for (unsigned int i = 1; i < size; i++) {
+			probe.load(lines[i]);
+		}
+		for (unsigned int i = 1; i < size; i++) {
+			probe.load(lines[i]);
+		}
+		break;
+	case SetTester::ZIG_ZAG:
+		for (unsigned int i = 1; i < size; i++) {
+			probe.load(lines[i]);
+		}
+		for (unsigned int i = size - 1; i >= 1; i--) {
+			probe.load(lines[i]);
+		}
+		break;
+	case SetTester::OVERLAPPING_WINDOWS:
+		for (unsigned int i = 1; i < size; i++) {
+			unsigned int end = std::min<unsigned int>(i + PATTERN_WINDOW, size);
+			for (unsigned int r = 0; r < PATTERN_REPEATS; r++) {
+				for (unsigned int j = i; j < end; j++) {
+					probe.load(lines[j]);
+				}
+			}
+		}
+		break;
+	default:
+		for (unsigned int i = 1; i < size; i++) {
+			probe.load(lines[i]);
+		}
+	}
+}
+
+template<typename Probe>
+inline int time_last_access(CacheLine::arr lines, unsigned long size, Probe& probe,
+		SetTester::AccessPattern pattern) __attribute__((always_inline));
+template<typename Probe>
+inline int time_last_access(CacheLine::arr lines, unsigned long size, Probe& probe,
+		SetTester::AccessPattern pattern) {
+	clearLines(lines, size, probe);
 
 	// Ensure the first address is cached by accessing it.
-	g_dummy[loc] += *(volatile int *) lines[0];
-	mfence();
-	// Now pull the other addresses through the cache too.
-	for (unsigned int i = 1; i < size; i++) {
-		g_dummy[loc] += *(volatile int *) lines[i];
-	}
-	mfence();
+	probe.load(lines[0]);
+	probe.fence();
+	// Now pull the other addresses through the cache too. The replacement
+	// policy is not LRU, so a single pass may not evict the first address.
+	access_lines(lines, size, probe, pattern);
+	probe.fence();
 	// See whether the first address got evicted from the cache by
 	// timing accessing it.
-	return time_access(lines[0], loc);
+	return probe.time(lines[0]);
 }
 
-inline int time_miss_access(CacheLine::ptr line, unsigned int loc)
+template<typename Probe>
+inline int time_miss_access(CacheLine::ptr line, Probe& probe)
 		__attribute__((always_inline));
-inline int time_miss_access(CacheLine::ptr line, unsigned int loc) {
-	line->flushFromCache();
-	mfence();
-	return time_access(line,loc);
+template<typename Probe>
+inline int time_miss_access(CacheLine::ptr line, Probe& probe) {
+	probe.flush(line);
+	probe.fence();
+	return probe.time(line);
 }
 
-inline int time_line_miss_access(CacheLine::ptr line, unsigned long runs) __attribute__((always_inline));
-inline int time_line_miss_access(CacheLine::ptr line, unsigned long runs) {
-	std::unique_ptr<int[]> times(new int[runs]);
-	unsigned int loc = rand() % DUMMY_SIZE;
-
-	iopl(3);
-	__asm__ __volatile__("cli");
+template<typename Probe>
+inline void time_line_miss_access(CacheLine::ptr line, unsigned long runs, int* times,
+		Probe& probe) __attribute__((always_inline));
+template<typename Probe>
+inline void time_line_miss_access(CacheLine::ptr line, unsigned long runs, int* times,
+		Probe& probe) {
+	probe.begin();
 	for (unsigned long run = 0; run < runs; run++) {
-		times[run] = time_miss_access(line, loc);
+		times[run] = time_miss_access(line, probe);
 	}
-	__asm__ __volatile__("sti");
-
-	return *std::min_element(times.get(), times.get() + runs);
+	probe.end();
 }
 
-inline void time_lines_safe(CacheLine::arr lines, unsigned long size, unsigned int loc,
-		int* times, unsigned long runs)  __attribute__((always_inline));
-inline void time_lines_safe(CacheLine::arr lines, unsigned long size, unsigned int loc,
-		int* times, unsigned long runs) {
-	iopl(3);
-	__asm__ __volatile__("cli");
+template<typename Probe>
+inline void time_lines_safe(CacheLine::arr lines, unsigned long size, int* times,
+		unsigned long runs, Probe& probe, SetTester::AccessPattern pattern)  __attribute__((always_inline));
+template<typename Probe>
+inline void time_lines_safe(CacheLine::arr lines, unsigned long size, int* times,
+		unsigned long runs, Probe& probe, SetTester::AccessPattern pattern) {
+	probe.begin();
 	for (unsigned long run = 0; run < runs; run++) {
-		times[run] = time_last_access(lines, size, loc);
+		times[run] = time_last_access(lines, size, probe, pattern);
 	}
-	__asm__ __volatile__("sti");
+	probe.end();
 }
 
-inline int time_lines(CacheLine::arr lines, unsigned long size,
-		unsigned long runs) __attribute__((always_inline));
-
-inline int time_lines(CacheLine::arr lines, unsigned long size,
-		unsigned long runs) {
-	std::unique_ptr<int[]> times(new int[runs]);
-	unsigned int loc = rand() % DUMMY_SIZE;
+template<typename Probe>
+inline int time_lines(CacheLine::arr lines, unsigned long size, unsigned long runs, int* times,
+		Probe& probe, SetTester::AccessPattern pattern) __attribute__((always_inline));
 
-	clearLines(lines, size);
-	time_lines_safe(lines, size, loc, times.get(), runs);
+template<typename Probe>
+inline int time_lines(CacheLine::arr lines, unsigned long size, unsigned long runs, int* times,
+		Probe& probe, SetTester::AccessPattern pattern) {
+	time_lines_safe(lines, size, times, runs, probe, pattern);
 
 	// Find the median time.  We use the median in order to discard
 	// outliers.  We want to discard outlying slow results which are
@@ -140,68 +338,323 @@ inline int time_lines(CacheLine::arr lines, unsigned long size,
 	// We also want to discard outliers where memory was accessed
 	// unusually quickly.  These could be the result of the CPU's
 	// eviction policy not using an exact LRU policy.
-	std::sort(times.get(), &times[runs]);
+	std::nth_element(times, times + runs / 2, times + runs);
 	int median_time = times[runs / 2];
 
 	return median_time;
 }
 
+/*
+ * A sequential probability ratio test: each sample above the threshold is
+ * evidence that the first line was evicted (i.e., on the same set), and each
+ * sample below it is evidence that it was not. Samples are taken in small
+ * batches until the log-likelihood ratio crosses one of the bounds.
+ */
+template<typename Probe>
 inline bool isOnSameSetAsTheFirst(CacheLine::arr lines, unsigned long size,
-		unsigned long runs, int llcMaxAccessTime) __attribute__((always_inline));
+		unsigned long maxRuns, int llcMaxAccessTime,
+		double highRatio, double lowRatio, double upperBound, double lowerBound,
+		int* times, unsigned long& samplesCount,
+		Probe& probe, SetTester::AccessPattern pattern) __attribute__((always_inline));
 
+template<typename Probe>
 inline bool isOnSameSetAsTheFirst(CacheLine::arr lines, unsigned long size,
-		unsigned long runs, int llcMaxAccessTime) {
-	std::unique_ptr<int[]> times(new int[runs]);
-	unsigned int loc = rand() % DUMMY_SIZE;
-
-//	clearLines(lines, size);
+		unsigned long maxRuns, int llcMaxAccessTime,
+		double highRatio, double lowRatio, double upperBound, double lowerBound,
+		int* times, unsigned long& samplesCount,
+		Probe& probe, SetTester::AccessPattern pattern) {
+	double ratio = 0;
+	samplesCount = 0;
+	for(unsigned long totalRuns = 0; totalRuns < maxRuns; totalRuns += SPRT_BATCH) {
+		time_lines_safe(lines, size, times + totalRuns, SPRT_BATCH, probe, pattern);
+		samplesCount += SPRT_BATCH;
+		for (unsigned long run = totalRuns; run < totalRuns + SPRT_BATCH; run++) {
+			ratio += times[run] > llcMaxAccessTime ? highRatio : lowRatio;
+		}
 
-	unsigned int higherCount = 0;
+		if(ratio >= upperBound) {
+			return true;
+		} else if(ratio <= lowerBound) {
+			return false;
+		}
+	}
 
-	const double highSafeFactor = 0.75;
-	const double lowSafeFactor = 1. - highSafeFactor;
-	const unsigned int maxRetries = 16;
-	unsigned long totalRuns = 0;
+	// Fallback. Better safe then sorry.
+	return false;
+}
 
-	for(unsigned int i=0; i < maxRetries; i++) {
-		time_lines_safe(lines, size, loc, times.get(), runs);
-		totalRuns += runs;
-		for (unsigned long run = 0; run < runs; run++) {
-			if(times[run] > llcMaxAccessTime) {
-				higherCount += 1;
+/*
+ * The measurements, as functors of the probe. Each takes its samples into
+ * times, and returns its result. The calibration is read when measuring,
+ * as it may change once the probe is picked (see SetTester::getPmu()).
+ */
+struct SameSetMeasurement {
+	const SetTester& tester;
+	CacheLine::arr lines;
+	unsigned long size;
+	unsigned long maxRuns;
+	SetTester::AccessPattern pattern;
+
+	template<typename Probe>
+	int operator()(Probe& probe, int* times, unsigned long& samplesCount) {
+		return isOnSameSetAsTheFirst(lines, size, maxRuns, tester.llcMaxAccessTime, tester.highRatio,
+				tester.lowRatio, tester.upperBound, -tester.upperBound, times, samplesCount, probe, pattern);
+	}
+};
+
+struct TimeMeasurement {
+	CacheLine::arr lines;
+	unsigned long size;
+	unsigned long runs;
+	SetTester::AccessPattern pattern;
+
+	template<typename Probe>
+	int operator()(Probe& probe, int* times, unsigned long& samplesCount) {
+		samplesCount = runs;
+		return time_lines(lines, size, runs, times, probe, pattern);
+	}
+};
+
+// The number of samples above the threshold
+struct EvictionMeasurement {
+	const SetTester& tester;
+	CacheLine::arr lines;
+	unsigned long size;
+	unsigned long runs;
+	SetTester::AccessPattern pattern;
+
+	template<typename Probe>
+	int operator()(Probe& probe, int* times, unsigned long& samplesCount) {
+		samplesCount = runs;
+		time_lines_safe(lines, size, times, runs, probe, pattern);
+
+		int evicted = 0;
+		for(unsigned long run = 0; run < runs; run++) {
+			if(times[run] > (int)tester.llcMaxAccessTime) {
+				evicted += 1;
 			}
 		}
+		return evicted;
+	}
+};
+
+// The fastest miss of the line
+struct MissMeasurement {
+	CacheLine::ptr line;
+	unsigned long runs;
+
+	template<typename Probe>
+	int operator()(Probe& probe, int* times, unsigned long& samplesCount) {
+		samplesCount = runs;
+		time_line_miss_access(line, runs, times, probe);
+		return *std::min_element(times, times + runs);
+	}
+};
+
+template<typename Measurement>
+int SetTester::measure(int kind, CacheLine::arr lines, unsigned int count, Measurement measurement) {
+	int* times = getTimes(lines[0]);
+	unsigned long samplesCount = 0;
+	// Each measurement takes a single draw on any backend, so a replay of
+	// the trace draws the same numbers as the recorded run
+	unsigned int draw = random();
+
+	int ret;
+	if(simulator != NULL) {
+		SimulatedProbe probe(simulator);
+		ret = measurement(probe, times, samplesCount);
+	} else if(trace != NULL && trace->isReplaying()) {
+		ReplayProbe probe(trace, kind, lines, count, draw);
+		ret = measurement(probe, times, samplesCount);
+		int recordedResult;
+		if(kind == MeasureTrace::SAME_SET && probe.getRecordedResult(recordedResult)) {
+			trace->countDecision(recordedResult == ret);
+		}
+	} else {
+		HardwareProbe probe(getScratch(lines[0], draw), getPmu(lines[0]));
+		ret = measurement(probe, times, samplesCount);
+	}
+
+	if(trace != NULL && trace->isRecording()) {
+		trace->recordMeasurement(kind, lines, count, times, samplesCount, ret);
+	}
+	return ret;
+}
+
+bool SetTester::isOnSameSet(unsigned int count) {
+	if(++testsSinceDriftCheck >= DRIFT_CHECK_TESTS) {
+		checkDrift();
+	}
+
+	SameSetMeasurement measurement = {*this, testLines, count, getSamplesCount(runs * SAME_SET_MAX_RETRIES),
+			accessPattern};
+	return measure(MeasureTrace::SAME_SET, testLines, count, measurement) != 0;
+}
+
+void SetTester::sampleFirst(LatencyHistogram& hits, LatencyHistogram& misses) {
+	// The hit and the miss times of the first line
+	unsigned long samplesCount = getSamplesCount(runs);
+	TimeMeasurement hit = {testLines, 1, samplesCount, SINGLE_PASS};
+	measure(MeasureTrace::SAMPLE_HIT, testLines, 1, hit);
+	hits.add(getTimes(testLines[0]), samplesCount);
+
+	MissMeasurement miss = {testLines[0], samplesCount};
+	measure(MeasureTrace::SAMPLE_MISS, testLines, 1, miss);
+	misses.add(getTimes(testLines[0]), samplesCount);
+}
+
+const PmuCounter* SetTester::getPmu(CacheLine::ptr line) {
+	if(!pmu.isOpen()) {
+		return NULL;
+	}
+	if(pmu.isScheduled()) {
+		return &pmu;
+	}
+
+	// The counter is not readable anymore, so the accesses are timed from
+	// now on. The calibration was in misses, so it is taken again.
+	pmu.close();
+	hitHistogram.clear();
+	missHistogram.clear();
+	recentHitHistogram.clear();
+	recentMissHistogram.clear();
+	llcMaxAccessTime = 0;
+
+	unsigned long samplesCount = getSamplesCount(runs);
+	TimeMeasurement hit = {&line, 1, samplesCount, SINGLE_PASS};
+	measure(MeasureTrace::SAMPLE_HIT, &line, 1, hit);
+	hitHistogram.add(getTimes(line), samplesCount);
+
+	MissMeasurement miss = {line, samplesCount};
+	measure(MeasureTrace::SAMPLE_MISS, &line, 1, miss);
+	missHistogram.add(getTimes(line), samplesCount);
+
+	avgHitAccessTime = hitHistogram.median();
+	avgMissAccessTime = missHistogram.median();
+	calibrateThreshold();
+	recalibrations += 1;
+	return NULL;
+}
+
+// A single sample should never decide the test
+static double clampRate(double rate) {
+	return std::min(std::max(rate, 0.01), 0.99);
+}
+
+bool SetTester::calibrateThreshold() {
+	double blend = avgHitAccessTime*0.85 + avgMissAccessTime*0.15;
+	if(hitHistogram.empty() || missHistogram.empty()) {
+		llcMaxAccessTime = blend;
+		return true;
+	}
+
+	int threshold = LatencyHistogram::otsuThreshold(hitHistogram, missHistogram);
+	double hitRate = clampRate(hitHistogram.rateAbove(threshold));
+	double missRate = clampRate(missHistogram.rateAbove(threshold));
+
+	// The threshold does not separate the samples yet. The previous
+	// threshold is kept, or the averages are blended if there is none.
+	if(missRate <= hitRate) {
+		if(llcMaxAccessTime == 0) {
+			llcMaxAccessTime = blend;
+		}
+		return false;
+	}
+
+	llcMaxAccessTime = threshold;
+	hitHighRate = hitRate;
+	missHighRate = missRate;
+	updateSequentialTest();
+	return true;
+}
+
+void SetTester::checkDrift() {
+	testsSinceDriftCheck = 0;
+	if(testLinesCount == 0) {
+		return;
+	}
 
-		if(higherCount > totalRuns*highSafeFactor) {
+	// Frequency, temperature and the load of the neighbours change over a
+	// run, so the calibration is compared to a window of recent samples
+	sampleFirst(recentHitHistogram, recentMissHistogram);
+	if(recentHitHistogram.size() < DRIFT_WINDOW_SAMPLES) {
+		return;
+	}
+
+	double hitRate = clampRate(recentHitHistogram.rateAbove(llcMaxAccessTime));
+	double missRate = clampRate(recentMissHistogram.rateAbove(llcMaxAccessTime));
+	if(std::abs(hitRate - hitHighRate) > DRIFT_TOLERANCE || std::abs(missRate - missHighRate) > DRIFT_TOLERANCE) {
+		std::swap(hitHistogram, recentHitHistogram);
+		std::swap(missHistogram, recentMissHistogram);
+		if(calibrateThreshold()) {
+			recalibrations += 1;
+		} else {
+			// The calibration is kept along with the samples it came from
+			std::swap(hitHistogram, recentHitHistogram);
+			std::swap(missHistogram, recentMissHistogram);
+		}
+	}
+
+	recentHitHistogram.clear();
+	recentMissHistogram.clear();
+}
+
+static const char* accessPatternNames[SetTester::ACCESS_PATTERNS_COUNT] = {
+	"single-pass", "double-pass", "zig-zag", "overlapping-windows"
+};
+
+const char* SetTester::getAccessPatternName(AccessPattern pattern) {
+	return pattern < ACCESS_PATTERNS_COUNT ? accessPatternNames[pattern] : "unknown";
+}
+
+bool SetTester::parseAccessPattern(const char* name, AccessPattern& pattern) {
+	for(int p = 0; p < ACCESS_PATTERNS_COUNT; p++) {
+		if(strcmp(name, accessPatternNames[p]) == 0) {
+			pattern = (AccessPattern)p;
 			return true;
-		} else if(higherCount < totalRuns*lowSafeFactor) {
-			return false;
 		}
 	}
 
-	// Fallback. Better safe then sorry.
 	return false;
 }
 
-bool SetTester::isOnSameSet(unsigned int count) {
-	switch(rand() % 3) {
-	case 0:
-		return isOnSameSetAsTheFirst(testLines, count, runs, llcMaxAccessTime);
-	case 1:
-		return isOnSameSetAsTheFirst(testLines, count, runs+2, llcMaxAccessTime);
-	case 2:
-	default:
-		return isOnSameSetAsTheFirst(testLines, count, runs+4, llcMaxAccessTime);
+SetTester::AccessPattern SetTester::calibrateAccessPattern(CacheLine::ptr line,
+		const CacheLine::vec& evictionSet, unsigned int count, double* evictionRates) {
+	clear();
+	add(line);
+	add(evictionSet, count);
+
+	// The patterns are ordered by cost, so a costlier pattern must evict
+	// noticeably more often to be picked
+	AccessPattern best = SINGLE_PASS;
+	double bestRate = -1;
+	for(int p = 0; p < ACCESS_PATTERNS_COUNT; p++) {
+		auto pattern = (AccessPattern)p;
+		EvictionMeasurement measurement = {*this, testLines, testLinesCount, PATTERN_CALIBRATION_RUNS, pattern};
+		int evicted = measure(MeasureTrace::PATTERN + p, testLines, testLinesCount, measurement);
+
+		double rate = (double)evicted / (double)PATTERN_CALIBRATION_RUNS;
+		if(evictionRates != NULL) {
+			evictionRates[p] = rate;
+		}
+		if(rate > bestRate + PATTERN_MIN_GAIN) {
+			best = pattern;
+			bestRate = rate;
+		}
 	}
-//	return double(time(count)) > avgMed * anomalyFactor;
+
+	accessPattern = best;
+	return best;
 }
 
 int SetTester::time(unsigned int count) {
-	return time_lines(testLines, count, runs);
+	TimeMeasurement measurement = {testLines, count, getSamplesCount(runs), accessPattern};
+	return measure(MeasureTrace::TIME, testLines, count, measurement);
 }
 
 int SetTester::timeMiss(CacheLine::ptr line) {
-	return time_line_miss_access(line, runs);
+	MissMeasurement measurement = {line, getSamplesCount(runs)};
+	return measure(MeasureTrace::TIME_MISS, &line, 1, measurement);
 }
 
 CacheLine::vec SetTester::getSameSetGroup(unsigned int availableWays) {
@@ -219,15 +672,10 @@ CacheLine::vec SetTester::getSameSetGroup(unsigned int availableWays) {
 	// then we know that all the group is in the same set, not need to check again.
 	if(testLinesCount == availableWays+1) {
 		foundCount = availableWays;
+	} else if(reductionMode == GROUP_REDUCTION) {
+		foundCount = groupReduction(availableWays);
 	} else {
-		// For each u: if without u the access time is short, then it is part of the set
-		for(unsigned int u=testLinesCount-1; u >= foundCount && foundCount < availableWays; u--) {
-			if(!isOnSameSet(u)) {
-				swap(foundCount, u);
-				foundCount++;
-				u++;
-			}
-		}
+		foundCount = linearReduction(availableWays);
 	}
 
 	if(foundCount >= availableWays) {
@@ -236,3 +684,57 @@ CacheLine::vec SetTester::getSameSetGroup(unsigned int availableWays) {
 
 	return res;
 }
+
+unsigned int SetTester::linearReduction(unsigned int availableWays) {
+	unsigned int foundCount = 1;
+
+	// For each u: if without u the access time is short, then it is part of the set
+	for(unsigned int u=testLinesCount-1; u >= foundCount && foundCount < availableWays; u--) {
+		if(!isOnSameSet(u)) {
+			swap(foundCount, u);
+			foundCount++;
+			u++;
+		}
+	}
+
+	return foundCount;
+}
+
+unsigned int SetTester::groupReduction(unsigned int availableWays) {
+	// The lines after the first one are split into ways+1 chunks. Since the
+	// first line is evicted, at-most ways of the chunks hold the lines that
+	// evict it, so at-least one chunk can be dropped.
+	// The group is shrunk by a factor of ways/(ways+1) on each round.
+	unsigned int count = testLinesCount;
+	const unsigned int chunks = availableWays + 1;
+
+	while(count - 1 > availableWays) {
+		unsigned int candidates = count - 1;
+		bool dropped = false;
+
+		for(unsigned int c=0; c < chunks && !dropped; ++c) {
+			unsigned int begin = 1 + (c * candidates) / chunks;
+			unsigned int end = 1 + ((c+1) * candidates) / chunks;
+			unsigned int chunkSize = end - begin;
+			if(chunkSize == 0) {
+				continue;
+			}
+
+			// Move the chunk to the end and test without it
+			std::rotate(testLines + begin, testLines + end, testLines + count);
+			if(isOnSameSet(count - chunkSize)) {
+				count -= chunkSize;
+				dropped = true;
+			} else {
+				std::rotate(testLines + begin, testLines + count - chunkSize, testLines + count);
+			}
+		}
+
+		// Every chunk is needed: the measurement is not reliable
+		if(!dropped) {
+			return 1;
+		}
+	}
+
+	return std::min(count, availableWays);
+}
@@ -0,0 +1,298 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <iostream>
+
+#include "slicehash.hpp"
+
+SliceHash::SliceHash(unsigned int blockShift) : learned(false) {
+	reset(blockShift);
+}
+
+void SliceHash::reset(unsigned int blockShift) {
+	learned = false;
+	this->blockShift = blockShift;
+	mask = ((1UL << SLICE_HASH_MAX_BIT) - 1) & ~((1UL << blockShift) - 1);
+
+	for(unsigned int bit = 0; bit < SLICE_HASH_MAX_BIT; bit++) {
+		basis[bit] = 0;
+	}
+	rank = 0;
+	observed = 0;
+	reference = 0;
+
+	samples.clear();
+	functions.clear();
+	table.clear();
+}
+
+void SliceHash::add(unsigned long physcialAddr, int slice) {
+	samples.push_back(make_pair(physcialAddr & mask, slice));
+}
+
+unsigned long SliceHash::reduce(const unsigned long* basis, unsigned long physcialAddr) {
+	for(int bit = SLICE_HASH_MAX_BIT - 1; bit >= 0; bit--) {
+		if(((physcialAddr >> bit) & 1) && basis[bit] != 0) {
+			physcialAddr ^= basis[bit];
+		}
+	}
+
+	return physcialAddr;
+}
+
+bool SliceHash::insert(unsigned long* basis, unsigned long diff) {
+	diff = reduce(basis, diff);
+	if(diff == 0) {
+		return false;
+	}
+
+	basis[63 - __builtin_clzl(diff)] = diff;
+	return true;
+}
+
+bool SliceHash::isConsistent(const unordered_map<unsigned long, int>& classes, unsigned long diff) {
+	// Two reduced classes merge iff they differ exactly by the reduced diff
+	for(auto c = classes.begin(); c != classes.end(); ++c) {
+		auto other = classes.find(c->first ^ diff);
+		if(other != classes.end() && other->second != c->second) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int SliceHash::findUnsupported(SliceHash::SampleIter learnedEnd) const {
+	// The difference of each sample from the first sample of its class is
+	// in the kernel. Each vector is supported by the differences that use it.
+	unordered_map<unsigned long, unsigned long> first;
+	unsigned long support[SLICE_HASH_MAX_BIT] = {0};
+	for(auto s = samples.cbegin(); s != learnedEnd; ++s) {
+		auto entry = first.insert(make_pair(reduce(basis, s->first), s->first));
+		unsigned long diff = entry.first->second ^ s->first;
+		for(int bit = SLICE_HASH_MAX_BIT - 1; bit >= 0 && diff != 0; bit--) {
+			if(((diff >> bit) & 1) && basis[bit] != 0) {
+				diff ^= basis[bit];
+				support[bit] += 1;
+			}
+		}
+	}
+
+	int weakest = -1;
+	for(unsigned int bit = 0; bit < SLICE_HASH_MAX_BIT; bit++) {
+		if(basis[bit] != 0 && support[bit] < SLICE_HASH_MIN_SUPPORT &&
+				(weakest < 0 || support[bit] < support[weakest])) {
+			weakest = bit;
+		}
+	}
+
+	return weakest;
+}
+
+bool SliceHash::learn(unsigned long heldOut) {
+	learned = false;
+	if(samples.size() <= heldOut) {
+		return false;
+	}
+
+	auto learnedEnd = samples.cbegin() + (samples.size() - heldOut);
+	reference = samples.front().first;
+	observed = 0;
+	for(auto s = samples.cbegin(); s != learnedEnd; ++s) {
+		observed |= s->first ^ reference;
+	}
+
+	// A difference that several pairs support is safe to extend the kernel
+	// with. With too few samples for that (e.g., all the sets share a few
+	// blocks), any consistent difference extends it, and the vectors that too
+	// few samples use are dropped after.
+	learned = (learnKernel(learnedEnd, SLICE_HASH_MIN_SUPPORT) && predictsHeldOut(learnedEnd)) ||
+			(learnKernel(learnedEnd, 1) && predictsHeldOut(learnedEnd));
+	return learned;
+}
+
+bool SliceHash::learnKernel(SliceHash::SampleIter learnedEnd, unsigned int minSupport) {
+	for(unsigned int bit = 0; bit < SLICE_HASH_MAX_BIT; bit++) {
+		basis[bit] = 0;
+	}
+	rank = 0;
+	table.clear();
+	functions.clear();
+
+	// The classes of the samples modulo the kernel, by their reduced value.
+	// Each sample either is in a class of its slice, or becomes a new class
+	// of its slice. The differences of the classes of the same slice are
+	// counted, and one that enough pairs support extends the kernel, if no
+	// classes of different slices merge by it.
+	unordered_map<unsigned long, unsigned int> pairs;
+	for(auto s = samples.cbegin(); s != learnedEnd; ++s) {
+		unsigned long value = reduce(basis, s->first);
+		auto entry = table.find(value);
+		if(entry != table.end()) {
+			if(entry->second != s->second) {
+				table.clear();
+				return false;
+			}
+			continue;
+		}
+
+		table.insert(make_pair(value, s->second));
+
+		unsigned long diff = 0;
+		for(auto c = table.begin(); c != table.end(); ++c) {
+			if(c->second != s->second || c->first == value) {
+				continue;
+			}
+
+			auto pair = pairs.find(c->first ^ value);
+			if(pair == pairs.end()) {
+				if(pairs.size() >= SLICE_HASH_MAX_PAIRS) {
+					continue;
+				}
+				pair = pairs.insert(make_pair(c->first ^ value, 0)).first;
+			}
+			pair->second += 1;
+
+			if(diff == 0 && pair->second >= minSupport && isConsistent(table, pair->first)) {
+				diff = pair->first;
+			}
+		}
+
+		if(diff != 0) {
+			insert(basis, diff);
+			rank += 1;
+
+			unordered_map<unsigned long, int> classes;
+			for(auto c = table.begin(); c != table.end(); ++c) {
+				classes.insert(make_pair(reduce(basis, c->first), c->second));
+			}
+			table.swap(classes);
+
+			// The differences are linear, so they are reduced as well
+			unordered_map<unsigned long, unsigned int> reduced;
+			for(auto p = pairs.begin(); p != pairs.end(); ++p) {
+				auto pairDiff = reduce(basis, p->first);
+				if(pairDiff != 0) {
+					reduced[pairDiff] += p->second;
+				}
+			}
+			pairs.swap(reduced);
+		}
+	}
+
+	// Each kernel vector must join several pairs of samples of a class.
+	// The weakest vector is dropped until all of them are supported, which
+	// only splits classes, so the kernel stays consistent.
+	for(int weakest = findUnsupported(learnedEnd); weakest >= 0; weakest = findUnsupported(learnedEnd)) {
+		basis[weakest] = 0;
+		rank -= 1;
+	}
+
+	table.clear();
+	for(auto s = samples.cbegin(); s != learnedEnd; ++s) {
+		table.insert(make_pair(reduce(basis, s->first), s->second));
+	}
+
+	// A kernel of rank 0 only knows the sampled blocks
+	calculateFunctions();
+	return rank > 0;
+}
+
+bool SliceHash::predictsHeldOut(SliceHash::SampleIter learnedEnd) const {
+	// The held-out samples must not contradict the hash, and some of them
+	// must be predicted by it
+	unsigned long predicted = 0;
+	for(auto s = learnedEnd; s != samples.cend(); ++s) {
+		int slice = lookup(s->first);
+		if(slice >= 0 && slice != s->second) {
+			return false;
+		}
+		predicted += slice >= 0 ? 1 : 0;
+	}
+
+	return predicted > 0;
+}
+
+void SliceHash::calculateFunctions() {
+	// Reduced row-echelon form: each pivot bit is only set in its own row
+	unsigned long reduced[SLICE_HASH_MAX_BIT];
+	std::copy(basis, basis + SLICE_HASH_MAX_BIT, reduced);
+	for(unsigned int pivot = blockShift; pivot < SLICE_HASH_MAX_BIT; pivot++) {
+		if(reduced[pivot] == 0) {
+			continue;
+		}
+		for(unsigned int row = pivot + 1; row < SLICE_HASH_MAX_BIT; row++) {
+			if((reduced[row] >> pivot) & 1) {
+				reduced[row] ^= reduced[pivot];
+			}
+		}
+	}
+
+	// A function per free observed bit: the bit itself, and each pivot whose row has it
+	functions.clear();
+	for(unsigned int free = blockShift; free < SLICE_HASH_MAX_BIT; free++) {
+		if(reduced[free] != 0 || !((observed >> free) & 1)) {
+			continue;
+		}
+
+		unsigned long function = 1UL << free;
+		for(unsigned int pivot = blockShift; pivot < SLICE_HASH_MAX_BIT; pivot++) {
+			if((reduced[pivot] >> free) & 1) {
+				function |= 1UL << pivot;
+			}
+		}
+		functions.push_back(function);
+	}
+}
+
+int SliceHash::getSlice(unsigned long physcialAddr) const {
+	if(!learned) {
+		return -1;
+	}
+
+	return lookup(physcialAddr);
+}
+
+int SliceHash::lookup(unsigned long physcialAddr) const {
+	// The samples tell nothing about the bits that never varied in them
+	physcialAddr &= mask;
+	if(((physcialAddr ^ reference) & ~observed) != 0) {
+		return -1;
+	}
+
+	auto entry = table.find(reduce(basis, physcialAddr));
+	return entry != table.end() ? entry->second : -1;
+}
+
+void SliceHash::print() const {
+	std::cout << "[HASH] Samples: " << dec << samples.size()
+			<< ", Kernel rank: " << rank
+			<< ", Functions: " << functions.size()
+			<< ", Table: " << table.size()
+			<< ", Observed bits: " << __builtin_popcountl(observed) << endl;
+	for(auto f = functions.begin(); f != functions.end(); ++f) {
+		std::cout << "   Bits:";
+		for(unsigned int bit = blockShift; bit < SLICE_HASH_MAX_BIT; bit++) {
+			if((*f >> bit) & 1) {
+				std::cout << " " << bit;
+			}
+		}
+		std::cout << endl;
+	}
+}
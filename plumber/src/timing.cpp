@@ -18,8 +18,265 @@
  */
 #include "timing.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <algorithm>
+#include <vector>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "latencyhistogram.hpp"
+#include "topology.h"
+
+TimerBackend g_timerBackend = RDTSC_TIMER;
+volatile unsigned long long g_timerCounter = 0;
+
+// The number of measurements of each backend when calibrating
+#define TIMER_CALIBRATION_SAMPLES 4096
+
+// The latency histograms cover this many times the miss time of the timer
+#define TIMER_HISTOGRAM_MISS_FACTOR 8
+#define TIMER_HISTOGRAM_MIN_BINS 256
+#define TIMER_HISTOGRAM_MAX_BINS (1 << 16)
+
+static unsigned int histogramBins = LATENCY_HISTOGRAM_BINS;
+
+static const char* timerNames[TIMER_BACKENDS_COUNT] = {
+	"rdtscp", "rdtsc", "counter-thread", "monotonic-raw"
+};
+
+static volatile bool counterRunning = false;
+static pthread_t counterThread;
+static int counterCpu = -1;
+
+static void* counterLoop(void*) {
+	while(counterRunning) {
+		g_timerCounter = g_timerCounter + 1;
+	}
+	return NULL;
+}
+
+static bool startCounterThread() {
+	if(counterRunning) {
+		return true;
+	}
+
+	// The counter spins on another physical core of the calibrating thread's
+	// socket, so it does not share the measuring core nor cross sockets
+	int cpu = sched_getcpu();
+	auto cpus = getOtherCoresCpus(getSocketCpus(getCpuSocket(cpu)), cpu);
+	if(cpu < 0 || cpus.empty()) {
+		return false;
+	}
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpus[0], &cpuset);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+
+	counterRunning = true;
+	int res = pthread_create(&counterThread, &attr, counterLoop, NULL);
+	pthread_attr_destroy(&attr);
+	if(res) {
+		counterRunning = false;
+		return false;
+	}
+
+	counterCpu = cpus[0];
+	return true;
+}
+
+static void stopCounterThread() {
+	if(counterRunning) {
+		counterRunning = false;
+		pthread_join(counterThread, NULL);
+		counterCpu = -1;
+	}
+}
+
+void stopTimers() {
+	stopCounterThread();
+}
+
+int getTimerCpu() {
+	return counterCpu;
+}
+
+// The bins of the latency histograms, by the miss time in the timer's units
+static void setHistogramBins(const TimerCalibration& calibration) {
+	double span = calibration.missTime * TIMER_HISTOGRAM_MISS_FACTOR;
+	histogramBins = TIMER_HISTOGRAM_MIN_BINS;
+	while(histogramBins < span && histogramBins < TIMER_HISTOGRAM_MAX_BINS) {
+		histogramBins <<= 1;
+	}
+}
+
+unsigned int getTimerHistogramBins() {
+	return histogramBins;
+}
+
+static bool isTimerAvailable(TimerBackend backend) {
+	switch(backend) {
+#if defined(__i386__) || defined(__x86_64__)
+	case RDTSCP_TIMER: {
+		unsigned int eax, ebx, ecx, edx;
+		return __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & (1 << 27));
+	}
+	case RDTSC_TIMER:
+		return true;
+#else
+	case RDTSCP_TIMER:
+		return false;
+	case RDTSC_TIMER:
+		return true;
+#endif
+	case COUNTER_THREAD_TIMER:
+		return startCounterThread();
+	case MONOTONIC_RAW_TIMER: {
+		timespec t;
+		return clock_gettime(CLOCK_MONOTONIC_RAW, &t) == 0;
+	}
+	default:
+		return false;
+	}
+}
+
+static double median(std::vector<double>& samples) {
+	std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+	return samples[samples.size() / 2];
+}
+
+static void flush(void* ptr) {
+#if defined(__i386__) || defined(__x86_64__)
+	asm volatile("clflush (%0)" :: "r"(ptr));
+#endif
+	mfence();
+}
+
+TimerCalibration calibrateTimer(TimerBackend backend) {
+	TimerCalibration res;
+	memset(&res, 0, sizeof(res));
+	res.available = isTimerAvailable(backend);
+	if(!res.available) {
+		return res;
+	}
+
+	TimerBackend prev = g_timerBackend;
+	g_timerBackend = backend;
+
+	std::vector<double> empty(TIMER_CALIBRATION_SAMPLES);
+	std::vector<double> hits(TIMER_CALIBRATION_SAMPLES);
+	std::vector<double> misses(TIMER_CALIBRATION_SAMPLES);
+	static int line[64] __attribute__((aligned(64)));
+	int dummy = 0;
+
+	for(unsigned int i = 0; i < TIMER_CALIBRATION_SAMPLES; i++) {
+		unsigned long long start = timerStart();
+		unsigned long long end = timerEnd();
+		empty[i] = end - start;
+
+		dummy += *(volatile int*)line;
+		mfence();
+		start = timerStart();
+		dummy += *(volatile int*)line;
+		end = timerEnd();
+		hits[i] = end - start;
+
+		flush(line);
+		start = timerStart();
+		dummy += *(volatile int*)line;
+		end = timerEnd();
+		misses[i] = end - start;
+	}
+	line[0] = dummy;
+
+	g_timerBackend = prev;
+
+	double mean = 0;
+	for(auto t = empty.begin(); t != empty.end(); ++t) {
+		mean += *t;
+	}
+	mean /= empty.size();
+	double variance = 0;
+	for(auto t = empty.begin(); t != empty.end(); ++t) {
+		variance += (*t - mean) * (*t - mean);
+	}
+
+	res.overhead = median(empty);
+	res.deviation = sqrt(variance / empty.size());
+	res.missTime = median(misses);
+	res.separation = res.missTime - median(hits);
+	// A miss must stand out of the noise of the timer itself
+	res.reliable = res.separation > 0 && res.separation > 3 * res.deviation;
+	return res;
+}
+
+TimerBackend calibrateTimers(bool verbose) {
+	TimerBackend best = TIMER_BACKENDS_COUNT;
+	TimerCalibration bestCalibration;
+	memset(&bestCalibration, 0, sizeof(bestCalibration));
+
+	for(int b = 0; b < TIMER_BACKENDS_COUNT; b++) {
+		auto backend = (TimerBackend)b;
+		auto calibration = calibrateTimer(backend);
+		if(verbose) {
+			std::cout << "[TIMER] " << getTimerName(backend) << ": ";
+			if(!calibration.available) {
+				std::cout << "not available" << std::endl;
+			} else {
+				std::cout << "overhead: " << calibration.overhead
+						<< ", deviation: " << calibration.deviation
+						<< ", separation: " << calibration.separation
+						<< (calibration.reliable ? "" : " (unreliable)") << std::endl;
+			}
+		}
+
+		// The units differ between backends, so the overhead is compared
+		// relative to the hit/miss separation
+		if(calibration.reliable && (best == TIMER_BACKENDS_COUNT ||
+				calibration.overhead / calibration.separation < bestCalibration.overhead / bestCalibration.separation)) {
+			best = backend;
+			bestCalibration = calibration;
+		}
+	}
+
+	if(best == TIMER_BACKENDS_COUNT) {
+		best = RDTSC_TIMER;
+		bestCalibration = calibrateTimer(best);
+	}
+	setHistogramBins(bestCalibration);
+	if(best != COUNTER_THREAD_TIMER) {
+		stopCounterThread();
+	}
+
+	g_timerBackend = best;
+	return best;
+}
+
+const char* getTimerName(TimerBackend backend) {
+	return backend < TIMER_BACKENDS_COUNT ? timerNames[backend] : "unknown";
+}
+
+bool setTimerBackend(const char* name) {
+	for(int b = 0; b < TIMER_BACKENDS_COUNT; b++) {
+		if(strcmp(name, timerNames[b]) == 0 && isTimerAvailable((TimerBackend)b)) {
+			g_timerBackend = (TimerBackend)b;
+			setHistogramBins(calibrateTimer(g_timerBackend));
+			return true;
+		}
+	}
+
+	return false;
+}
 
 timespec timediff(timespec start, timespec end) {
 	timespec temp;
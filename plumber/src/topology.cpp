@@ -0,0 +1,145 @@
+/*
+ * Author: Liran Funaro <liran.funaro@gmail.com>
+ *
+ * Copyright (C) 2006-2018 Liran Funaro
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <utility>
+
+#include "topology.h"
+
+static int readCpuPackage(int cpu) {
+	char path[256];
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+
+	ifstream f(path);
+	int package = -1;
+	if (f) {
+		f >> package;
+	}
+
+	return package;
+}
+
+static int readCpuCore(int cpu) {
+	char path[256];
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+
+	ifstream f(path);
+	int core = -1;
+	if (f) {
+		f >> core;
+	}
+
+	return core;
+}
+
+static int getCpusCount() {
+	return sysconf(_SC_NPROCESSORS_CONF);
+}
+
+unsigned int getSocketsCount() {
+	int maxPackage = 0;
+	for (int cpu = 0; cpu < getCpusCount(); cpu++) {
+		int package = readCpuPackage(cpu);
+		if (package > maxPackage) {
+			maxPackage = package;
+		}
+	}
+
+	return maxPackage + 1;
+}
+
+vector<int> getSocketCpus(int socket) {
+	vector<int> res;
+	for (int cpu = 0; cpu < getCpusCount(); cpu++) {
+		if (readCpuPackage(cpu) == socket) {
+			res.push_back(cpu);
+		}
+	}
+
+	return res;
+}
+
+int getCpuSocket(int cpu) {
+	return readCpuPackage(cpu);
+}
+
+int getCpuNode(int cpu) {
+	char path[256];
+	for (int node = 0; node < getCpusCount(); node++) {
+		sprintf(path, "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+		if (access(path, F_OK) == 0) {
+			return node;
+		}
+	}
+
+	return -1;
+}
+
+int getSocketNode(int socket) {
+	auto cpus = getSocketCpus(socket);
+	if (cpus.empty()) {
+		return -1;
+	}
+
+	return getCpuNode(cpus[0]);
+}
+
+vector<int> getPhysicalCoreCpus(const vector<int>& cpus) {
+	vector<int> res;
+	set<pair<int, int>> cores;
+	for (auto cpu = cpus.begin(); cpu != cpus.end(); ++cpu) {
+		if (cores.insert(make_pair(readCpuPackage(*cpu), readCpuCore(*cpu))).second) {
+			res.push_back(*cpu);
+		}
+	}
+
+	return res;
+}
+
+vector<int> getOtherCoresCpus(const vector<int>& cpus, int cpu) {
+	if (cpu < 0) {
+		return cpus;
+	}
+
+	// Without a topology, each CPU is its own core
+	auto core = make_pair(readCpuPackage(cpu), readCpuCore(cpu));
+	vector<int> res;
+	for (auto c = cpus.begin(); c != cpus.end(); ++c) {
+		bool sameCore = core.second < 0 ? *c == cpu : make_pair(readCpuPackage(*c), readCpuCore(*c)) == core;
+		if (!sameCore) {
+			res.push_back(*c);
+		}
+	}
+
+	return res;
+}
+
+bool pinThreadToCpus(const vector<int>& cpus) {
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	for (auto cpu = cpus.begin(); cpu != cpus.end(); ++cpu) {
+		CPU_SET(*cpu, &cpuset);
+	}
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0;
+}